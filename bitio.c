@@ -1,3 +1,5 @@
+#define _GNU_SOURCE  // copy_file_range, splice
+
 #include "bitio.h"
 #include "common.h"
 
@@ -5,6 +7,11 @@
 #include <string.h>
 #include <endian.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // https://gcc.gnu.org/bugzilla/show_bug.cgi?id=59098
 #define COMBINE(mask, ifzero, ifone) ((mask) ? ((typeof(mask)) ~(mask)) ? (((mask) & (ifone)) | (~(mask) & (ifzero))) : (ifone) : (ifzero))
@@ -12,24 +19,6 @@
 #define CYC_RSHFT(bits, value, amount) COMBINE((1 << ((bits) - (amount))) - 1, (value) << ((bits) - (amount)), (value) >> (amount))
 #define BYTE_OF_BIT(ptr, offset) (*(((uint8_t*) (ptr)) + ((offset) >> 3)))
 #define BYTE_OF_START(slc) BYTE_OF_BIT((slc).ptr, (slc).offset)
-#define LONG_OF_BIT(ptr, offset) (*(((uint64_t*) (ptr)) + ((offset) >> 6)))
-#define LONG_OF_START(slc) LONG_OF_BIT((slc).ptr, (slc).offset)
-
-inline static void
-copy_inside_byte_bitaligned(BitSlice * dstptr, BitConstSlice * srcptr, BitSSize * remainingptr, BitUSize advance)
-{
-	uint8_t c = BYTE_OF_START(*srcptr);
-	if ((BitUSize) *remainingptr < advance)
-		advance = *remainingptr;
-	int mask_shift = (dstptr->offset + advance) & 7;
-	uint8_t mask = 0xff >> (8 - advance);
-	mask = CYC_RSHFT(8, mask, mask_shift);
-	BYTE_OF_START(*dstptr) = COMBINE(mask, BYTE_OF_START(*dstptr), c);
-	*remainingptr -= advance;
-	BIT_SLICE_ADVANCE_INPLACE(*srcptr, advance);
-	BIT_SLICE_ADVANCE_INPLACE(dstptr->as_const, advance);
-}
-
 inline static void
 copy_inside_byte(BitSlice * dstptr, BitConstSlice * srcptr, BitSSize * remainingptr, BitUSize advance)
 {
@@ -47,22 +36,123 @@ copy_inside_byte(BitSlice * dstptr, BitConstSlice * srcptr, BitSSize * remaining
 	BIT_SLICE_ADVANCE_INPLACE(dstptr->as_const, advance);
 }
 
+// Kernels for the byte-aligned middle of an unaligned copy:
+// dst[i] = src[i] << shift | src[i + 1] >> (8 - shift), reading length + 1 bytes of src
+typedef void (*ShiftMergeKernel)(uint8_t * dst, const uint8_t * src, size_t length, unsigned shift);
+
+static void
+shift_merge_bytes_scalar(uint8_t * dst, const uint8_t * src, size_t length, unsigned shift)
+{
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, src + i, 8);
+		word = (be64toh(word) << shift) | (src[i + 8] >> (8 - shift));
+		word = htobe64(word);
+		memcpy(dst + i, &word, 8);
+	}
+	for (; i < length; ++i)
+		dst[i] = (src[i] << shift) | (src[i + 1] >> (8 - shift));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAS_SHIFT_MERGE_SIMD 1
+
+// There are no 8-bit vector shifts, so shift 16-bit lanes and mask off bits that crossed a byte
+__attribute__((target("sse2"))) static void
+shift_merge_bytes_sse2(uint8_t * dst, const uint8_t * src, size_t length, unsigned shift)
+{
+	__m128i lcount = _mm_cvtsi32_si128(shift);
+	__m128i rcount = _mm_cvtsi32_si128(8 - shift);
+	__m128i lmask = _mm_set1_epi8((uint8_t) (0xff << shift));
+	__m128i rmask = _mm_set1_epi8((uint8_t) (0xff >> (8 - shift)));
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i cur = _mm_loadu_si128((const __m128i *) (src + i));
+		__m128i next = _mm_loadu_si128((const __m128i *) (src + i + 1));
+		__m128i hi = _mm_and_si128(_mm_sll_epi16(cur, lcount), lmask);
+		__m128i lo = _mm_and_si128(_mm_srl_epi16(next, rcount), rmask);
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(hi, lo));
+	}
+	shift_merge_bytes_scalar(dst + i, src + i, length - i, shift);
+}
+
+__attribute__((target("avx2"))) static void
+shift_merge_bytes_avx2(uint8_t * dst, const uint8_t * src, size_t length, unsigned shift)
+{
+	__m128i lcount = _mm_cvtsi32_si128(shift);
+	__m128i rcount = _mm_cvtsi32_si128(8 - shift);
+	__m256i lmask = _mm256_set1_epi8((uint8_t) (0xff << shift));
+	__m256i rmask = _mm256_set1_epi8((uint8_t) (0xff >> (8 - shift)));
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		__m256i cur = _mm256_loadu_si256((const __m256i *) (src + i));
+		__m256i next = _mm256_loadu_si256((const __m256i *) (src + i + 1));
+		__m256i hi = _mm256_and_si256(_mm256_sll_epi16(cur, lcount), lmask);
+		__m256i lo = _mm256_and_si256(_mm256_srl_epi16(next, rcount), rmask);
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_or_si256(hi, lo));
+	}
+	shift_merge_bytes_sse2(dst + i, src + i, length - i, shift);
+}
+#else
+#define HAS_SHIFT_MERGE_SIMD 0
+#endif
+
+static ShiftMergeKernel
+select_shift_merge_kernel(void)
+{
+#if HAS_SHIFT_MERGE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &shift_merge_bytes_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return &shift_merge_bytes_sse2;
+#endif
+	return &shift_merge_bytes_scalar;
+}
+
+static ShiftMergeKernel shift_merge_bytes = NULL;
+
+bool
+bit_slice_copy_use_kernel(enum bit_copy_kernel kernel)
+{
+	switch (kernel) {
+	case BIT_COPY_KERNEL_SCALAR:
+		shift_merge_bytes = &shift_merge_bytes_scalar;
+		return true;
+#if HAS_SHIFT_MERGE_SIMD
+	case BIT_COPY_KERNEL_SSE2:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("sse2"))
+			return false;
+		shift_merge_bytes = &shift_merge_bytes_sse2;
+		return true;
+	case BIT_COPY_KERNEL_AVX2:
+		__builtin_cpu_init();
+		if (!__builtin_cpu_supports("avx2"))
+			return false;
+		shift_merge_bytes = &shift_merge_bytes_avx2;
+		return true;
+#else
+	case BIT_COPY_KERNEL_SSE2:
+	case BIT_COPY_KERNEL_AVX2:
+		return false;
+#endif
+	}
+	return false;
+}
+
+// Copies bits that don't fill a whole destination byte
 inline static void
-copy_inside_long(BitSlice * dstptr, BitConstSlice * srcptr, BitSSize * remainingptr, BitUSize advance)
+copy_partial_bytes(BitSlice * dstptr, BitConstSlice * srcptr, BitSSize * remainingptr, bool until_dst_aligned)
 {
-	BitUSize imbalance = (srcptr->offset - dstptr->offset) & 63;
-	uint64_t c = LONG_OF_START(*srcptr);
-	c = CYC_RSHFT(64, c, imbalance);
-	if ((BitUSize) *remainingptr < advance)
-		advance = *remainingptr;
-	int mask_shift = (dstptr->offset + advance) & 63;
-	uint64_t mask = 0xffffffffffffffffULL >> (64 - advance);
-	mask = CYC_RSHFT(64, mask, mask_shift);
-	mask = htobe64(mask);
-	LONG_OF_START(*dstptr) = COMBINE(mask, LONG_OF_START(*dstptr), c);
-	*remainingptr -= advance;
-	BIT_SLICE_ADVANCE_INPLACE(*srcptr, advance);
-	BIT_SLICE_ADVANCE_INPLACE(dstptr->as_const, advance);
+	while (*remainingptr > 0 && (!until_dst_aligned || (dstptr->offset & 7))) {
+		BitUSize maxadv_src = 8 - (srcptr->offset & 7);
+		BitUSize maxadv_dst = 8 - (dstptr->offset & 7);
+		BitUSize maxadv = maxadv_src > maxadv_dst ? maxadv_dst : maxadv_src;
+		copy_inside_byte(dstptr, srcptr, remainingptr, maxadv);
+	}
 }
 
 BitUSize
@@ -72,46 +162,115 @@ bit_slice_copy(BitSlice dst, BitConstSlice src)
 	if (length > src.length)
 		length = src.length;
 	BitSSize remaining = length;
-	BitUSize imbalance = (src.offset - dst.offset) & 7;
-	if ((imbalance == 0) && false) {
-		// offset & 7 = 0 => mask = 0xff
-		// offset & 7 = 7 => mask = 0x01
-		copy_inside_byte_bitaligned(&dst, &src, &remaining, 8 - (src.offset & 7));
-
-		assert((src.offset & 7) == 0);
-		assert((dst.offset & 7) == 0);
-		size_t whole_bytes = remaining >> 3;
-		memcpy(&BYTE_OF_START(dst), &BYTE_OF_START(src), whole_bytes);
+	copy_partial_bytes(&dst, &src, &remaining, true);
+	size_t whole_bytes = remaining >> 3;
+	if (whole_bytes) {
+		unsigned shift = src.offset & 7;
+		if (!shift) {
+			memcpy(&BYTE_OF_START(dst), &BYTE_OF_START(src), whole_bytes);
+		} else {
+			// src has bits past the last whole destination byte, so reading one more byte is safe
+			if (!shift_merge_bytes)
+				shift_merge_bytes = select_shift_merge_kernel();
+			shift_merge_bytes(&BYTE_OF_START(dst), &BYTE_OF_START(src), whole_bytes, shift);
+		}
 		BitUSize advance = whole_bytes << 3;
 		remaining -= advance;
 		BIT_SLICE_ADVANCE_INPLACE(src, advance);
 		BIT_SLICE_ADVANCE_INPLACE(dst.as_const, advance);
+	}
+	assert(remaining < 8);
+	copy_partial_bytes(&dst, &src, &remaining, false);
+	assert(remaining == 0);
+	return length - (remaining > 0 ? remaining : 0);
+}
 
-		assert(remaining < 8);
-		assert(remaining >= 0);
-		assert((src.offset & 7) == 0);
-		assert((dst.offset & 7) == 0);
-		copy_inside_byte(&dst, &src, &remaining, remaining);
-	} else {
-		while (remaining >= 64) {
-			BitUSize maxadv_src = 64 - (src.offset & 63);
-			BitUSize maxadv_dst = 64 - (dst.offset & 63);
-			BitUSize maxadv = maxadv_src > maxadv_dst ? maxadv_dst : maxadv_src;
-			copy_inside_long(&dst, &src, &remaining, maxadv);
+static size_t
+stdio_backend_read(BitIO * io, uint8_t * ptr, size_t length)
+{
+	return fread(ptr, 1, length, io->file);
+}
+
+static void
+stdio_backend_write(BitIO * io, struct iovec * chunks, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		if (fwrite(chunks[i].iov_base, 1, chunks[i].iov_len, io->file) < chunks[i].iov_len) {
+			fprintf(stderr, "Failed to write output\n");
+			exit(1);
+		}
+	}
+}
+
+static bool
+stdio_backend_skip(BitIO * io, off_t length)
+{
+	return !fseeko(io->file, length, SEEK_CUR);
+}
+
+static const BitIOBackend stdio_backend = {
+	.read = &stdio_backend_read,
+	.write = &stdio_backend_write,
+	.skip = &stdio_backend_skip,
+};
+
+static size_t
+fd_backend_read(BitIO * io, uint8_t * ptr, size_t length)
+{
+	while (true) {
+		ssize_t read_bytes = read(io->fd, ptr, length);
+		if (read_bytes >= 0)
+			return read_bytes;
+		if (errno != EINTR) {
+			fprintf(stderr, "Failed to read input\n");
+			exit(1);
+		}
+	}
+}
+
+static void
+fd_backend_write(BitIO * io, struct iovec * chunks, int count)
+{
+	while (count) {
+		if (!chunks->iov_len) {
+			++chunks;
+			--count;
+			continue;
 		}
-		while (remaining > 0) {
-			BitUSize maxadv_src = 8 - (src.offset & 7);
-			BitUSize maxadv_dst = 8 - (dst.offset & 7);
-			BitUSize maxadv = maxadv_src > maxadv_dst ? maxadv_dst : maxadv_src;
-			copy_inside_byte(&dst, &src, &remaining, maxadv);
+		ssize_t written = writev(io->fd, chunks, count);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to write output\n");
+			exit(1);
+		}
+		for (; count && (size_t) written >= chunks->iov_len; ++chunks, --count)
+			written -= chunks->iov_len;
+		if (count) {
+			chunks->iov_base = (uint8_t *) chunks->iov_base + written;
+			chunks->iov_len -= written;
 		}
 	}
-	assert(remaining == 0);
-	return length - (remaining > 0 ? remaining : 0);
 }
 
-BitIO
-file_to_bit_io(FILE * file, size_t in_byte_size, size_t out_byte_size)
+static bool
+fd_backend_skip(BitIO * io, off_t length)
+{
+	// Terminals and some devices accept lseek without moving
+	struct stat st;
+	if (fstat(io->fd, &st) || !S_ISREG(st.st_mode))
+		return false;
+	return lseek(io->fd, length, SEEK_CUR) >= 0;
+}
+
+static const BitIOBackend fd_backend = {
+	.read = &fd_backend_read,
+	.write = &fd_backend_write,
+	.skip = &fd_backend_skip,
+};
+
+static BitIO
+backend_to_bit_io(const BitIOBackend * backend, FILE * file, int fd, size_t in_byte_size, size_t out_byte_size)
 {
 	if (!in_byte_size)
 		in_byte_size = 1;
@@ -124,95 +283,431 @@ file_to_bit_io(FILE * file, size_t in_byte_size, size_t out_byte_size)
 		exit(1);
 	}
 	BitIO io = {
+		.backend = backend,
 		.file = file,
+		.fd = fd,
 		.in_buffer = {
 			.data = in_data,
 			.byte_size = in_byte_size,
+			.max_byte_size = in_byte_size,
 			.io_length = 0,
 			.used_bits = 0,
 		},
 		.out_buffer = {
 			.data = out_data,
 			.byte_size = out_byte_size,
+			.max_byte_size = out_byte_size,
 			.io_length = 0,
 			.used_bits = 0,
 		},
+		.in_acc = {0, 0},
+		.out_acc = {0, 0},
 	};
 	return io;
 }
 
+BitIO
+file_to_bit_io(FILE * file, size_t in_byte_size, size_t out_byte_size)
+{
+	return backend_to_bit_io(&stdio_backend, file, fileno(file), in_byte_size, out_byte_size);
+}
+
+BitIO
+fd_to_bit_io(int fd, size_t in_byte_size, size_t out_byte_size)
+{
+	return backend_to_bit_io(&fd_backend, NULL, fd, in_byte_size, out_byte_size);
+}
+
 void
 free_bit_io(BitIO io)
 {
-	free(io.in_buffer.data);
+	if (io.backend->close)
+		io.backend->close(&io);
+	if (io.in_mapped) {
+		// Leave the file offset right after the consumed input, as reading would have
+		off_t consumed = (io.in_buffer.used_bits - io.in_acc.count) >> 3;
+		lseek(io.fd, io.in_map_offset + consumed, SEEK_SET);
+		munmap(io.in_buffer.data, io.in_buffer.byte_size);
+	} else {
+		free(io.in_buffer.data);
+	}
 	free(io.out_buffer.data);
 }
 
+bool
+bit_io_map_input(BitIO * io)
+{
+	int fd = io->fd;
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return false;
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0 || offset >= st.st_size)
+		return false;
+	long page_size = sysconf(_SC_PAGESIZE);
+	off_t map_offset = page_size > 0 ? offset - offset % page_size : 0;
+	size_t map_length = st.st_size - map_offset;
+	void * data = mmap(NULL, map_length, PROT_READ, MAP_PRIVATE, fd, map_offset);
+	if (data == MAP_FAILED)
+		return false;
+	// Only hints, failures don't matter
+	madvise(data, map_length, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	madvise(data, map_length, MADV_HUGEPAGE);
+#endif
+	free(io->in_buffer.data);
+	io->in_buffer = (BitBuffer) {
+		.data = data,
+		.byte_size = map_length,
+		.max_byte_size = map_length,
+		.io_length = map_length,
+		.used_bits = (offset - map_offset) << 3,
+	};
+	io->in_mapped = true;
+	io->in_map_offset = map_offset;
+	io->in_eof = true;
+	return true;
+}
+
+void
+bit_io_set_max_buffer_sizes(BitIO * io, size_t in_max_byte_size, size_t out_max_byte_size)
+{
+	io->in_buffer.max_byte_size = in_max_byte_size;
+	io->out_buffer.max_byte_size = out_max_byte_size;
+}
+
+// Doubles the buffer, contents and positions are kept
+static void
+bit_buffer_grow(BitBuffer * buf)
+{
+	if (buf->byte_size >= buf->max_byte_size)
+		return;
+	size_t new_byte_size = buf->byte_size << 1;
+	if (new_byte_size > buf->max_byte_size)
+		new_byte_size = buf->max_byte_size;
+	uint8_t * new_data = realloc(buf->data, new_byte_size);
+	if (!new_data) {
+		// Not fatal, keep going with the current size
+		buf->max_byte_size = buf->byte_size;
+		return;
+	}
+	buf->data = new_data;
+	buf->byte_size = new_byte_size;
+}
+
+// Input side: in_buffer.used_bits stays byte-aligned, a partially consumed byte lives in in_acc
+
+// Reads more input after the unconsumed bytes, returns false if nothing was read.
+// Consumed bytes are only discarded once there is no free space left behind the data.
+static bool
+bit_io_fill_in_buffer(BitIO * io)
+{
+	BitBuffer *buf = &io->in_buffer;
+	if (io->in_eof)
+		return false;
+	if (io->backend->swap_in) {
+		assert((buf->used_bits >> 3) == buf->io_length);
+		size_t read_bytes = io->backend->swap_in(io);
+		if (!read_bytes)
+			io->in_eof = true;
+		return read_bytes > 0;
+	}
+	if ((buf->used_bits >> 3) == buf->io_length) {
+		buf->used_bits = 0;
+		buf->io_length = 0;
+	} else if (buf->io_length == buf->byte_size) {
+		size_t consumed_bytes = buf->used_bits >> 3;
+		bit_buffer_compact(buf, buf->io_length);
+		buf->io_length -= consumed_bytes;
+	}
+	size_t available_space = buf->byte_size - buf->io_length;
+	size_t read_bytes = io->backend->read(io, buf->data + buf->io_length, available_space);
+	buf->io_length += read_bytes;
+	if (!read_bytes) {
+		io->in_eof = true;
+	} else if (read_bytes == buf->byte_size) {
+		// The input could have filled a larger buffer
+		bit_buffer_grow(buf);
+	}
+	return read_bytes > 0;
+}
+
+// Tops in_acc up to at least 57 bits, unless the input has ended
+static void
+bit_io_refill_in_acc(BitIO * io)
+{
+	BitAccumulator *acc = &io->in_acc;
+	BitBuffer *buf = &io->in_buffer;
+	while (acc->count <= 56) {
+		size_t pos = buf->used_bits >> 3;
+		size_t available = buf->io_length - pos;
+		if (!available) {
+			if (!bit_io_fill_in_buffer(io))
+				return;
+			continue;
+		}
+		size_t take = (64 - acc->count) >> 3;
+		if (take > available)
+			take = available;
+		uint64_t word = 0;
+		if (available >= 8) {
+			memcpy(&word, buf->data + pos, 8);
+			word = be64toh(word);
+		} else {
+			for (size_t i = 0; i < available; ++i)
+				word |= (uint64_t) buf->data[pos + i] << (56 - (i << 3));
+		}
+		if (take < 8)
+			word &= ~(UINT64_MAX >> (take << 3));
+		acc->bits |= word >> acc->count;
+		acc->count += take << 3;
+		buf->used_bits += take << 3;
+	}
+}
+
+uint64_t
+bit_io_read_bits_slow(BitIO * io, BitUSize amount)
+{
+	if (!amount)
+		return 0;
+	BitAccumulator *acc = &io->in_acc;
+	if (amount <= acc->count)
+		return bit_io_read_bits(io, amount);
+	// Take what is left, then refill from empty, which yields 64 bits unless at the end of input
+	BitUSize head = acc->count;
+	BitUSize tail = amount - head;
+	uint64_t value = head ? acc->bits >> (64 - head) : 0;
+	*acc = (BitAccumulator) {0, 0};
+	bit_io_refill_in_acc(io);
+	// Missing bits past the end of input read as zeroes
+	uint64_t tail_value = acc->bits >> (64 - tail);
+	acc->bits = (acc->bits << (tail - 1)) << 1;
+	acc->count = acc->count > tail ? acc->count - tail : 0;
+	return ((value << (tail - 1)) << 1) | tail_value;
+}
+
 BitUSize
-bit_io_write(BitIO * io, BitConstSlice * slcptr, BitUSize amount)
+bit_io_read(BitIO * io, BitSlice * slcptr, BitUSize amount)
 {
-	BitConstSlice slc = *slcptr;
+	BitSlice slc = *slcptr;
 	if (amount > slc.length)
 		amount = slc.length;
 	BitSSize remaining = amount;
-	while (remaining > 0) {
-		BitSlice io_slice = bit_buffer_remaining_to_slice(io->out_buffer);
-		BitUSize advance = bit_slice_l_copy(io_slice, slc, remaining);
+	BitAccumulator *acc = &io->in_acc;
+	if (acc->count && remaining > 0) {
+		BitUSize advance = (BitUSize) remaining > acc->count ? acc->count : (BitUSize) remaining;
+		uint64_t value = htobe64(acc->bits);
+		BitConstSlice value_slice = BIT_SLICE_REFERENCE_INT(value);
+		bit_slice_l_copy(slc, value_slice, advance);
+		acc->bits = (acc->bits << (advance - 1)) << 1;
+		acc->count -= advance;
 		remaining -= advance;
-		BIT_SLICE_ADVANCE_INPLACE(slc, advance);
-		BIT_SLICE_ADVANCE_INPLACE(io_slice.as_const, advance);
-		io->out_buffer.used_bits += advance;
-		if (io_slice.length <= 8) {
-			size_t to_delete_bytes = io->out_buffer.io_length;
-			BitUSize to_delete = to_delete_bytes << 3;
-			io->out_buffer.used_bits -= to_delete;
-			memmove(io->out_buffer.data, io->out_buffer.data + to_delete_bytes, io->out_buffer.byte_size - to_delete_bytes);
-			io->out_buffer.io_length -= to_delete_bytes;
-		}
-		size_t write_bytes = (io->out_buffer.used_bits >> 3) - io->out_buffer.io_length;
-		if (write_bytes) {
-			write_bytes = fwrite(io->out_buffer.data + io->out_buffer.io_length, 1, write_bytes, io->file);
-			io->out_buffer.io_length += write_bytes;
+		BIT_SLICE_ADVANCE_INPLACE(slc.as_const, advance);
+	}
+	BitBuffer *buf = &io->in_buffer;
+	while (remaining > 0) {
+		BitConstSlice io_slice = bit_buffer_remaining_valid_to_slice(*buf).as_const;
+		if (!io_slice.length) {
+			if (bit_io_fill_in_buffer(io))
+				continue;
+			// Bits past the end of input read as zeroes
+			uint64_t zero = 0;
+			BitConstSlice zero_slice = BIT_SLICE_REFERENCE_INT(zero);
+			while (remaining > 0) {
+				BitUSize advance = bit_slice_l_copy(slc, zero_slice, remaining);
+				remaining -= advance;
+				BIT_SLICE_ADVANCE_INPLACE(slc.as_const, advance);
+			}
+			break;
 		}
+		BitUSize advance = bit_slice_l_copy(slc, io_slice, remaining);
+		remaining -= advance;
+		BIT_SLICE_ADVANCE_INPLACE(slc.as_const, advance);
+		buf->used_bits += advance;
+	}
+	BitUSize partial_bits = buf->used_bits & 7;
+	if (partial_bits) {
+		uint8_t last_byte = buf->data[buf->used_bits >> 3] << partial_bits;
+		acc->bits = (uint64_t) last_byte << 56;
+		acc->count = 8 - partial_bits;
+		buf->used_bits += acc->count;
 	}
 	assert(remaining == 0);
 	return amount - remaining;
 }
 
+void
+bit_io_skip(BitIO * io, uint64_t amount)
+{
+	BitAccumulator *acc = &io->in_acc;
+	BitUSize head = acc->count < amount ? acc->count : amount;
+	bit_io_read_bits(io, head);
+	amount -= head;
+	// A mapped input is all in the buffer, so this covers it
+	BitBuffer *buf = &io->in_buffer;
+	uint64_t buffered_bits = (buf->io_length << 3) - buf->used_bits;
+	uint64_t advance = amount < buffered_bits ? amount & ~(uint64_t) 7 : buffered_bits;
+	buf->used_bits += advance;
+	amount -= advance;
+	uint64_t skip_bytes = amount >> 3;
+	if (skip_bytes && !io->in_eof && buf->used_bits == buf->io_length << 3) {
+		if (io->backend->skip && io->backend->skip(io, skip_bytes)) {
+			amount &= 7;
+		} else {
+			// Pipes and the like, read and drop
+			while (amount >= 8 && bit_io_fill_in_buffer(io)) {
+				buffered_bits = (buf->io_length << 3) - buf->used_bits;
+				advance = amount < buffered_bits ? amount & ~(uint64_t) 7 : buffered_bits;
+				buf->used_bits += advance;
+				amount -= advance;
+			}
+		}
+	}
+	// More than a partial byte left over means the input has ended
+	if (amount && amount < 8)
+		bit_io_read_bits_slow(io, amount);
+}
+
+bool
+bit_io_read_eof(BitIO * io)
+{
+	if (io->in_acc.count)
+		return false;
+	if (io->in_buffer.used_bits < io->in_buffer.io_length << 3)
+		return false;
+	return !bit_io_fill_in_buffer(io);
+}
+
+// Output side: out_buffer.used_bits stays byte-aligned, an unfinished byte lives in out_acc
+
+// Writes out the finished bytes followed by length bytes at ptr, keeps an unfinished byte at the start of the buffer
+static void
+bit_io_drain_out_buffer_with(BitIO * io, const uint8_t * ptr, size_t length)
+{
+	BitBuffer *buf = &io->out_buffer;
+	if (io->backend->swap_out) {
+		io->backend->swap_out(io, ptr, length);
+		return;
+	}
+	size_t finished_bytes = buf->used_bits >> 3;
+	struct iovec chunks[2] = {
+		{.iov_base = buf->data + buf->io_length, .iov_len = finished_bytes - buf->io_length},
+		{.iov_base = (void *) ptr, .iov_len = length},
+	};
+	if (chunks[0].iov_len || chunks[1].iov_len)
+		io->backend->write(io, chunks, 2);
+	bit_buffer_compact(buf, finished_bytes + ((buf->used_bits & 7) ? 1 : 0));
+	buf->io_length = 0;
+	if (finished_bytes == buf->byte_size) {
+		// The output could have filled a larger buffer
+		bit_buffer_grow(buf);
+	}
+}
+
+static void
+bit_io_drain_out_buffer(BitIO * io)
+{
+	bit_io_drain_out_buffer_with(io, NULL, 0);
+}
+
+static void
+bit_io_store_out_bytes(BitIO * io, const uint8_t * bytes, size_t length)
+{
+	BitBuffer *buf = &io->out_buffer;
+	while (length) {
+		size_t pos = buf->used_bits >> 3;
+		size_t space = buf->byte_size - pos;
+		if (!space) {
+			bit_io_drain_out_buffer(io);
+			continue;
+		}
+		size_t advance = space > length ? length : space;
+		memcpy(buf->data + pos, bytes, advance);
+		buf->used_bits += advance << 3;
+		bytes += advance;
+		length -= advance;
+	}
+}
+
+// Moves whole bytes of out_acc into out_buffer
+static void
+bit_io_spill_out_acc(BitIO * io)
+{
+	BitAccumulator *acc = &io->out_acc;
+	size_t spill_bytes = acc->count >> 3;
+	if (!spill_bytes)
+		return;
+	uint64_t word = htobe64(acc->bits);
+	bit_io_store_out_bytes(io, (const uint8_t *) &word, spill_bytes);
+	BitUSize spilled = spill_bytes << 3;
+	acc->bits = (acc->bits << (spilled - 1)) << 1;
+	acc->count -= spilled;
+}
+
+void
+bit_io_write_bits_slow(BitIO * io, uint64_t value, BitUSize amount)
+{
+	if (!amount)
+		return;
+	BitAccumulator *acc = &io->out_acc;
+	BitUSize head = 64 - acc->count;
+	if (head > amount)
+		head = amount;
+	BitUSize tail = amount - head;
+	if (head) {
+		acc->bits |= ((value >> tail) << (64 - head)) >> acc->count;
+		acc->count += head;
+	}
+	bit_io_spill_out_acc(io);
+	if (tail) {
+		acc->bits |= (value << (64 - tail)) >> acc->count;
+		acc->count += tail;
+	}
+}
+
 BitUSize
-bit_io_read(BitIO * io, BitSlice * slcptr, BitUSize amount)
+bit_io_write(BitIO * io, BitConstSlice * slcptr, BitUSize amount)
 {
-	BitSlice slc = *slcptr;
+	BitConstSlice slc = *slcptr;
 	if (amount > slc.length)
 		amount = slc.length;
 	BitSSize remaining = amount;
+	BitAccumulator *acc = &io->out_acc;
+	BitBuffer *buf = &io->out_buffer;
+	bit_io_spill_out_acc(io);
+	if (acc->count) {
+		// Continue the copy right after the unfinished byte
+		if ((buf->used_bits >> 3) == buf->byte_size)
+			bit_io_drain_out_buffer(io);
+		buf->data[buf->used_bits >> 3] = acc->bits >> 56;
+		buf->used_bits += acc->count;
+		*acc = (BitAccumulator) {0, 0};
+	}
+	if (!(buf->used_bits & 7) && !(slc.offset & 7) && (size_t) remaining >= buf->byte_size << 3) {
+		// Too large to buffer, write the whole bytes right after the buffered ones
+		size_t direct_bytes = remaining >> 3;
+		bit_io_drain_out_buffer_with(io, &BYTE_OF_START(slc), direct_bytes);
+		BitUSize advance = direct_bytes << 3;
+		remaining -= advance;
+		BIT_SLICE_ADVANCE_INPLACE(slc, advance);
+	}
 	while (remaining > 0) {
-		BitSSize read_bits = remaining - ((io->in_buffer.io_length << 3) - io->in_buffer.used_bits);
-		if (read_bits < 0)
-			read_bits = 0;
-		size_t read_bytes = read_bits ? ((read_bits - 1) >> 3) + 1 : 0;
-		size_t available_space = io->in_buffer.byte_size - io->in_buffer.io_length;
-		if (read_bytes > available_space)
-			read_bytes = available_space;
-		if (read_bytes) {
-			size_t read_bytes_success = fread(io->in_buffer.data + io->in_buffer.io_length, 1, read_bytes, io->file);
-			if (!read_bytes_success) {
-				memset(io->in_buffer.data + io->in_buffer.io_length, 0, read_bytes);
-				read_bytes_success = read_bytes;
-				io->in_eof = true;
-			}
-			io->in_buffer.io_length += read_bytes_success;
+		BitSlice io_slice = bit_buffer_remaining_to_slice(*buf);
+		if (!io_slice.length) {
+			bit_io_drain_out_buffer(io);
+			continue;
 		}
-		BitConstSlice io_slice = bit_buffer_remaining_valid_to_slice(io->in_buffer).as_const;
-		BitUSize advance = bit_slice_l_copy(slc, io_slice, remaining);
+		BitUSize advance = bit_slice_l_copy(io_slice, slc, remaining);
 		remaining -= advance;
-		BIT_SLICE_ADVANCE_INPLACE(slc.as_const, advance);
-		io->in_buffer.used_bits += advance;
-		size_t to_delete_bytes = io->in_buffer.used_bits >> 3;
-		BitUSize to_delete = to_delete_bytes << 3;
-		io->in_buffer.used_bits -= to_delete;
-		io->in_buffer.io_length -= to_delete_bytes;
-		memmove(io->out_buffer.data, io->out_buffer.data + to_delete_bytes, io->out_buffer.byte_size - to_delete_bytes);
+		BIT_SLICE_ADVANCE_INPLACE(slc, advance);
+		buf->used_bits += advance;
+	}
+	BitUSize partial_bits = buf->used_bits & 7;
+	if (partial_bits) {
+		uint8_t last_byte = buf->data[buf->used_bits >> 3] & (uint8_t) (0xff << (8 - partial_bits));
+		acc->bits = (uint64_t) last_byte << 56;
+		acc->count = partial_bits;
+		buf->used_bits -= partial_bits;
 	}
 	assert(remaining == 0);
 	return amount - remaining;
@@ -221,15 +716,89 @@ bit_io_read(BitIO * io, BitSlice * slcptr, BitUSize amount)
 void
 bit_io_flush(BitIO * io)
 {
-	BitUSize unfinished_bits = io->out_buffer.used_bits & 7;
-	if (unfinished_bits) {
-		uint64_t zero = 0;
-		BitConstSlice zero_slice = BIT_SLICE_REFERENCE_INT(zero);
-		bit_io_write(io, &zero_slice, 8 - unfinished_bits);
+	BitAccumulator *acc = &io->out_acc;
+	// Unused low bits of the accumulator are zero, so this pads the unfinished byte
+	acc->count = (acc->count + 7) & ~7;
+	bit_io_spill_out_acc(io);
+	bit_io_drain_out_buffer(io);
+}
+
+size_t
+bit_io_splice(BitIO * in, BitIO * out, size_t length)
+{
+	if (in->backend != &fd_backend || out->backend != &fd_backend || in->in_mapped)
+		return 0;
+	if (in->in_acc.count || (in->in_buffer.used_bits >> 3) != in->in_buffer.io_length)
+		return 0;
+	if (out->out_acc.count & 7)
+		return 0;
+	bit_io_spill_out_acc(out);
+	bit_io_drain_out_buffer(out);
+	size_t moved = 0;
+	bool use_copy_file_range = true;
+	while (moved < length) {
+		ssize_t result;
+		if (use_copy_file_range) {
+			// Works between regular files, can share extents on filesystems supporting that
+			result = copy_file_range(in->fd, NULL, out->fd, NULL, length - moved, 0);
+			if (result < 0 && errno != EINTR) {
+				use_copy_file_range = false;
+				continue;
+			}
+		} else {
+			// Works when at least one side is a pipe
+			result = splice(in->fd, NULL, out->fd, NULL, length - moved, SPLICE_F_MOVE);
+			if (result < 0 && errno != EINTR)
+				break;
+		}
+		if (!result) {
+			in->in_eof = true;
+			break;
+		}
+		if (result > 0)
+			moved += result;
+	}
+	return moved;
+}
+
+void
+bit_io_copy(BitIO * in, BitIO * out, uint64_t amount)
+{
+	// Bits already taken into in_acc go through the accumulators, after that the input is byte-aligned
+	BitUSize head = in->in_acc.count < amount ? in->in_acc.count : amount;
+	bit_io_write_bits(out, bit_io_read_bits(in, head), head);
+	amount -= head;
+	BitBuffer *buf = &in->in_buffer;
+	bool try_splice = true;
+	while (amount) {
+		BitConstSlice io_slice = bit_buffer_remaining_valid_to_slice(*buf).as_const;
+		if (!io_slice.length && try_splice && amount >= 8 && !(out->out_acc.count & 7)) {
+			size_t moved = bit_io_splice(in, out, amount >> 3);
+			amount -= (uint64_t) moved << 3;
+			// Give up on it once it fails, the buffers take over from here
+			try_splice = moved > 0;
+			continue;
+		}
+		if (!io_slice.length) {
+			if (bit_io_fill_in_buffer(in))
+				continue;
+			// Bits past the end of input read as zeroes
+			static const uint8_t zeroes[4096];
+			while (amount) {
+				BitConstSlice zero_slice = {.ptr = zeroes, .offset = 0, .length = sizeof(zeroes) << 3};
+				amount -= bit_io_write(out, &zero_slice, amount);
+			}
+			break;
+		}
+		BitUSize advance = bit_io_write(out, &io_slice, amount);
+		buf->used_bits += advance;
+		amount -= advance;
 	}
-	size_t write_bytes = (io->out_buffer.used_bits >> 3) - io->out_buffer.io_length;
-	if (write_bytes) {
-		write_bytes = fwrite(io->out_buffer.data + io->out_buffer.io_length, 1, write_bytes, io->file);
-		io->out_buffer.io_length += write_bytes;
+	BitUSize partial_bits = buf->used_bits & 7;
+	if (partial_bits) {
+		uint8_t last_byte = buf->data[buf->used_bits >> 3] << partial_bits;
+		in->in_acc.bits = (uint64_t) last_byte << 56;
+		in->in_acc.count = 8 - partial_bits;
+		buf->used_bits += in->in_acc.count;
 	}
 }
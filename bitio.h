@@ -8,6 +8,9 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 typedef size_t BitUSize;
 typedef ssize_t BitSSize;
@@ -43,19 +46,60 @@ bit_subslice_inplace(BitConstSlice * slcptr, BitUSize start, BitUSize endlen)
 
 typedef struct {
 	size_t byte_size;
+	size_t max_byte_size;  // Grows up to this size while the stream keeps filling or draining it completely
 	size_t io_length;  // Place into which to read?
 	BitUSize used_bits;
 	uint8_t * data;
 } BitBuffer;
 
+// Up to 64 bits already taken from (or not yet put into) a BitBuffer
 typedef struct {
-	FILE * file;
+	uint64_t bits;  // MSB-aligned, unused low bits are zero
+	BitUSize count;
+} BitAccumulator;
+
+typedef struct bit_io BitIO;
+
+typedef struct {
+	// Reads at most length bytes, returns 0 only at the end of input
+	size_t (*read)(BitIO * io, uint8_t * ptr, size_t length);
+	// Writes all chunks in order
+	void (*write)(BitIO * io, struct iovec * chunks, int count);
+	// Optional, replaces the fully consumed in_buffer with fresh input, returns its length, 0 at the end of input
+	size_t (*swap_in)(BitIO * io);
+	// Optional, takes over the finished bytes of out_buffer followed by length bytes at ptr, and leaves a buffer
+	// starting with the unfinished byte
+	void (*swap_out)(BitIO * io, const uint8_t * ptr, size_t length);
+	// Optional, moves the input position length bytes forward without reading, returns false if it can't
+	bool (*skip)(BitIO * io, off_t length);
+	// Optional, finishes pending work, called by free_bit_io
+	void (*close)(BitIO * io);
+} BitIOBackend;
+
+struct bit_io {
+	const BitIOBackend * backend;
+	FILE * file;  // Only for the stdio backend
+	int fd;
 	BitBuffer in_buffer, out_buffer;
+	BitAccumulator in_acc, out_acc;
 	bool in_eof;
-} BitIO;
+	bool in_mapped;  // in_buffer.data is a read-only mapping of the whole rest of the file
+	off_t in_map_offset;  // File offset of in_buffer.data when mapped
+	void * backend_data;
+};
 
 BitUSize bit_slice_copy(BitSlice dst, BitConstSlice src);
 
+// Kernels for copies whose source and destination bit phases differ, the first copy picks the best one the CPU has
+enum bit_copy_kernel {
+	BIT_COPY_KERNEL_SCALAR,
+	BIT_COPY_KERNEL_SSE2,
+	BIT_COPY_KERNEL_AVX2,
+};
+
+// Makes bit_slice_copy use kernel from now on (tests use it), returns false if the CPU or build lacks it
+bool bit_slice_copy_use_kernel(enum bit_copy_kernel kernel);
+
 __attribute__((unused)) inline static BitUSize
 bit_slice_l_copy(BitSlice dst, BitConstSlice src, BitUSize length)
 {
@@ -81,12 +125,76 @@ bit_buffer_used_to_slice(BitBuffer buf)
 	return (BitSlice) {.ptr = buf.data, .offset = 0, .length = buf.used_bits};
 }
 
+// Moves the bytes that still hold unconsumed (or unwritten) bits to the start of the buffer
+__attribute__((unused)) inline static void
+bit_buffer_compact(BitBuffer * buf, size_t end_byte)
+{
+	size_t start_byte = buf->used_bits >> 3;
+	if (!start_byte)
+		return;
+	if (end_byte > start_byte)
+		memmove(buf->data, buf->data + start_byte, end_byte - start_byte);
+	buf->used_bits -= start_byte << 3;
+}
+
 BitIO file_to_bit_io(FILE * file, size_t in_byte_size, size_t out_byte_size);
+// Uses read(2)/writev(2) directly, without stdio buffering in between
+BitIO fd_to_bit_io(int fd, size_t in_byte_size, size_t out_byte_size);
 
 void free_bit_io(BitIO io);
 
+// Replaces the input buffer with a mapping of the rest of the file, if it is a regular one
+bool bit_io_map_input(BitIO * io);
+
+// Move reading ahead and writing behind to background threads, the buffers then keep their current size
+bool bit_io_start_prefetch(BitIO * io);
+bool bit_io_start_write_behind(BitIO * io);
+// Keep several reads or writes in flight through io_uring, false if the kernel doesn't support it or the stream isn't a plain file descriptor
+bool bit_io_start_uring_input(BitIO * io);
+bool bit_io_start_uring_output(BitIO * io);
+
+void bit_io_set_max_buffer_sizes(BitIO * io, size_t in_max_byte_size, size_t out_max_byte_size);
+
 BitUSize bit_io_write(BitIO * io, BitConstSlice * slcptr, BitUSize amount);
 BitUSize bit_io_read(BitIO * io, BitSlice * slcptr, BitUSize amount);
 void bit_io_flush(BitIO * io);  // Dosn't call underlying flush
+bool bit_io_read_eof(BitIO * io);
+
+// Moves up to length bytes from in to out inside the kernel, if both are raw fds and nothing is buffered on
+// either side. Returns the number of bytes moved, 0 if it's not possible.
+size_t bit_io_splice(BitIO * in, BitIO * out, size_t length);
+// Drops amount bits of input, seeking past what isn't buffered when the input allows it
+void bit_io_skip(BitIO * io, uint64_t amount);
+// Moves amount bits from in to out in bulk, splicing when both sides allow it. Missing input bits are written as zeroes.
+void bit_io_copy(BitIO * in, BitIO * out, uint64_t amount);
+
+uint64_t bit_io_read_bits_slow(BitIO * io, BitUSize amount);
+void bit_io_write_bits_slow(BitIO * io, uint64_t value, BitUSize amount);
+
+// Fast paths for fields of at most 64 bits, value is LSB-aligned
+__attribute__((unused)) inline static uint64_t
+bit_io_read_bits(BitIO * io, BitUSize amount)
+{
+	BitAccumulator *acc = &io->in_acc;
+	if (amount && amount <= acc->count) {
+		uint64_t value = acc->bits >> (64 - amount);
+		acc->bits = (acc->bits << (amount - 1)) << 1;
+		acc->count -= amount;
+		return value;
+	}
+	return bit_io_read_bits_slow(io, amount);
+}
+
+__attribute__((unused)) inline static void
+bit_io_write_bits(BitIO * io, uint64_t value, BitUSize amount)
+{
+	BitAccumulator *acc = &io->out_acc;
+	if (amount && acc->count + amount <= 64) {
+		acc->bits |= (value << (64 - amount)) >> acc->count;
+		acc->count += amount;
+		return;
+	}
+	bit_io_write_bits_slow(io, value, amount);
+}
 
 #endif /* end of include guard: BITIO_H_ */
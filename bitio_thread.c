@@ -0,0 +1,299 @@
+#include "bitio.h"
+#include "common.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+// Buffers per stream: one used by the interpreter, the rest being read or written in the background
+#define BIT_IO_THREAD_BUFFERS 4
+// Polls of an empty queue before parking, the other side usually hands a buffer over within a read or write
+#define BIT_IO_THREAD_SPINS 4096
+
+typedef struct {
+	uint8_t * data;
+	size_t start, length;
+} BitIOChunk;
+
+// Single-producer single-consumer queue, never holds more than BIT_IO_THREAD_BUFFERS chunks.
+// Hand-offs only touch atomics, a consumer that spun on an empty queue for long parks on tail with a futex.
+typedef struct {
+	BitIOChunk items[BIT_IO_THREAD_BUFFERS];
+	unsigned head;  // Only used by the consumer
+	atomic_uint tail;  // Chunks pushed so far, the futex word
+	atomic_bool parked;  // The consumer waits on tail, so the producer has to wake it
+} BitIOChunkQueue;
+
+typedef struct {
+	BitIOBackend backend;
+	const BitIOBackend * base;
+	BitIO * io;
+	pthread_t thread;
+	bool running;
+	atomic_bool stopping;  // Checked by the thread between reads
+	int stop_fd;  // Made readable to stop a prefetch thread waiting for input, -1 for stdio streams
+	size_t buffer_size;
+	uint8_t * buffers[BIT_IO_THREAD_BUFFERS];
+	BitIOChunkQueue to_thread, from_thread;
+} BitIOThreadState;
+
+static void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void
+chunk_queue_init(BitIOChunkQueue * queue)
+{
+	queue->head = 0;
+	atomic_init(&queue->tail, 0);
+	atomic_init(&queue->parked, false);
+}
+
+static void
+chunk_queue_push(BitIOChunkQueue * queue, BitIOChunk chunk)
+{
+	unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	queue->items[tail % BIT_IO_THREAD_BUFFERS] = chunk;
+	// Sequentially consistent with the consumer's parked store and tail check, so one of them sees the other
+	atomic_store(&queue->tail, tail + 1);
+	if (atomic_load(&queue->parked))
+		syscall(SYS_futex, &queue->tail, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static BitIOChunk
+chunk_queue_pop(BitIOChunkQueue * queue)
+{
+	unsigned head = queue->head;
+	for (unsigned spins = 0; atomic_load_explicit(&queue->tail, memory_order_acquire) == head; ++spins) {
+		if (spins < BIT_IO_THREAD_SPINS) {
+			cpu_relax();
+			continue;
+		}
+		atomic_store(&queue->parked, true);
+		// Returns right away if a push came in meanwhile, spurious returns just go around again
+		if (atomic_load(&queue->tail) == head)
+			syscall(SYS_futex, &queue->tail, FUTEX_WAIT_PRIVATE, head, NULL, NULL, 0);
+		atomic_store_explicit(&queue->parked, false, memory_order_relaxed);
+	}
+	BitIOChunk chunk = queue->items[head % BIT_IO_THREAD_BUFFERS];
+	queue->head = head + 1;
+	return chunk;
+}
+
+static BitIOThreadState *
+bit_io_thread_state_new(BitIO * io, BitBuffer * buf)
+{
+	BitIOThreadState * state = calloc(1, sizeof(BitIOThreadState));
+	if (!state) {
+		fprintf(stderr, "Failed to allocate IO thread state\n");
+		exit(1);
+	}
+	state->base = io->backend;
+	state->backend = *io->backend;
+	// The thread reads ahead, so the file position is past the buffered input
+	state->backend.skip = NULL;
+	state->io = io;
+	state->stop_fd = -1;
+	atomic_init(&state->stopping, false);
+	state->buffer_size = buf->byte_size;
+	state->buffers[0] = buf->data;
+	for (size_t i = 1; i < BIT_IO_THREAD_BUFFERS; ++i) {
+		if (!(state->buffers[i] = malloc(state->buffer_size))) {
+			fprintf(stderr, "Failed to allocate IO buffer!\n");
+			exit(1);
+		}
+	}
+	chunk_queue_init(&state->to_thread);
+	chunk_queue_init(&state->from_thread);
+	// The pool is fixed, so the buffers can't grow anymore
+	buf->max_byte_size = buf->byte_size;
+	return state;
+}
+
+static void
+bit_io_thread_state_delete(BitIOThreadState * state, uint8_t * current_buffer)
+{
+	// current_buffer is still owned by the BitIO
+	for (size_t i = 0; i < BIT_IO_THREAD_BUFFERS; ++i) {
+		if (state->buffers[i] != current_buffer)
+			free(state->buffers[i]);
+	}
+	if (state->stop_fd >= 0)
+		close(state->stop_fd);
+	free(state);
+}
+
+// Prefetch: empty buffers go to the thread, filled ones come back, a zero-length chunk marks the end of input.
+// Closing sets stopping and queues a chunk without data, which the thread returns on.
+
+// Returns false when the stream is closed before there is input
+static bool
+prefetch_wait_for_input(BitIOThreadState * state)
+{
+	// A stdio stream may hold input of its own, so its thread just reads and closing waits for that read
+	if (state->stop_fd < 0)
+		return true;
+	struct pollfd fds[] = {
+		{.fd = state->io->fd, .events = POLLIN},
+		{.fd = state->stop_fd, .events = POLLIN},
+	};
+	while (poll(fds, 2, -1) < 0) {
+		if (errno != EINTR)
+			return true;
+	}
+	return !fds[1].revents;
+}
+
+static void *
+prefetch_thread_main(void * arg)
+{
+	BitIOThreadState * state = arg;
+	while (true) {
+		BitIOChunk chunk = chunk_queue_pop(&state->to_thread);
+		if (!chunk.data || atomic_load(&state->stopping) || !prefetch_wait_for_input(state))
+			return NULL;
+		chunk.start = 0;
+		chunk.length = state->base->read(state->io, chunk.data, state->buffer_size);
+		chunk_queue_push(&state->from_thread, chunk);
+		if (!chunk.length)
+			return NULL;
+	}
+}
+
+static size_t
+prefetch_swap_in(BitIO * io)
+{
+	BitIOThreadState * state = io->backend_data;
+	chunk_queue_push(&state->to_thread, (BitIOChunk) {.data = io->in_buffer.data});
+	BitIOChunk chunk = chunk_queue_pop(&state->from_thread);
+	io->in_buffer.data = chunk.data;
+	io->in_buffer.io_length = chunk.length;
+	io->in_buffer.used_bits = 0;
+	if (!chunk.length)
+		state->running = false;
+	return chunk.length;
+}
+
+static void
+prefetch_close(BitIO * io)
+{
+	BitIOThreadState * state = io->backend_data;
+	if (state->running) {
+		// Possibly waiting for input nobody needs anymore
+		atomic_store(&state->stopping, true);
+		if (state->stop_fd >= 0)
+			eventfd_write(state->stop_fd, 1);
+		chunk_queue_push(&state->to_thread, (BitIOChunk) {.data = NULL});
+	}
+	pthread_join(state->thread, NULL);
+	bit_io_thread_state_delete(state, io->in_buffer.data);
+}
+
+bool
+bit_io_start_prefetch(BitIO * io)
+{
+	if (io->in_mapped || io->backend->swap_in)
+		return false;
+	BitIOThreadState * state = bit_io_thread_state_new(io, &io->in_buffer);
+	state->backend.swap_in = &prefetch_swap_in;
+	state->backend.close = &prefetch_close;
+	if (!io->file)
+		state->stop_fd = eventfd(0, EFD_CLOEXEC);
+	for (size_t i = 1; i < BIT_IO_THREAD_BUFFERS; ++i)
+		chunk_queue_push(&state->to_thread, (BitIOChunk) {.data = state->buffers[i]});
+	if (pthread_create(&state->thread, NULL, &prefetch_thread_main, state)) {
+		bit_io_thread_state_delete(state, io->in_buffer.data);
+		return false;
+	}
+	state->running = true;
+	io->backend = &state->backend;
+	io->backend_data = state;
+	return true;
+}
+
+// Write-behind: full buffers go to the thread, written ones come back, a chunk without data stops the thread
+
+static void *
+write_behind_thread_main(void * arg)
+{
+	BitIOThreadState * state = arg;
+	while (true) {
+		BitIOChunk chunk = chunk_queue_pop(&state->to_thread);
+		if (!chunk.data)
+			return NULL;
+		struct iovec iov = {.iov_base = chunk.data + chunk.start, .iov_len = chunk.length};
+		state->base->write(state->io, &iov, 1);
+		chunk_queue_push(&state->from_thread, chunk);
+	}
+}
+
+static void
+write_behind_swap_out(BitIO * io, const uint8_t * ptr, size_t length)
+{
+	BitIOThreadState * state = io->backend_data;
+	BitBuffer * buf = &io->out_buffer;
+	size_t finished_bytes = buf->used_bits >> 3;
+	uint8_t unfinished_byte = buf->data[finished_bytes < buf->byte_size ? finished_bytes : 0];
+	if (finished_bytes > buf->io_length) {
+		chunk_queue_push(&state->to_thread, (BitIOChunk) {
+			.data = buf->data,
+			.start = buf->io_length,
+			.length = finished_bytes - buf->io_length,
+		});
+		buf->data = chunk_queue_pop(&state->from_thread).data;
+	}
+	// ptr belongs to the caller, so it has to be copied before returning
+	while (length) {
+		size_t advance = length > state->buffer_size ? state->buffer_size : length;
+		memcpy(buf->data, ptr, advance);
+		chunk_queue_push(&state->to_thread, (BitIOChunk) {
+			.data = buf->data,
+			.start = 0,
+			.length = advance,
+		});
+		buf->data = chunk_queue_pop(&state->from_thread).data;
+		ptr += advance;
+		length -= advance;
+	}
+	buf->data[0] = unfinished_byte;
+	buf->used_bits &= 7;
+	buf->io_length = 0;
+}
+
+static void
+write_behind_close(BitIO * io)
+{
+	BitIOThreadState * state = io->backend_data;
+	chunk_queue_push(&state->to_thread, (BitIOChunk) {.data = NULL});
+	pthread_join(state->thread, NULL);
+	bit_io_thread_state_delete(state, io->out_buffer.data);
+}
+
+bool
+bit_io_start_write_behind(BitIO * io)
+{
+	if (io->backend->swap_out)
+		return false;
+	BitIOThreadState * state = bit_io_thread_state_new(io, &io->out_buffer);
+	state->backend.swap_out = &write_behind_swap_out;
+	state->backend.close = &write_behind_close;
+	for (size_t i = 1; i < BIT_IO_THREAD_BUFFERS; ++i)
+		chunk_queue_push(&state->from_thread, (BitIOChunk) {.data = state->buffers[i]});
+	if (pthread_create(&state->thread, NULL, &write_behind_thread_main, state)) {
+		bit_io_thread_state_delete(state, io->out_buffer.data);
+		return false;
+	}
+	io->backend = &state->backend;
+	io->backend_data = state;
+	return true;
+}
@@ -0,0 +1,520 @@
+#include "bitio.h"
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAS_IO_URING 1
+#else
+#define HAS_IO_URING 0
+#endif
+
+#if HAS_IO_URING
+
+// Buffers per stream: one used by the interpreter, the rest queued for or in the middle of a read or write
+#define BIT_IO_URING_BUFFERS 4
+#define BIT_IO_URING_CANCEL_USER_DATA UINT64_MAX
+
+typedef struct {
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+	bool current_position;  // Offset -1 means the file position
+} BitIORing;
+
+typedef struct {
+	uint8_t * data;
+	size_t start, length;
+	off_t offset;
+	uint64_t seq;  // Order in the stream
+	int32_t result;
+	enum {
+		URBUF_FREE,
+		URBUF_CURRENT,  // In in_buffer or out_buffer
+		URBUF_QUEUED,  // Waiting for a submission slot
+		URBUF_IN_FLIGHT,
+		URBUF_DONE,
+	} state;
+} BitIOURingBuffer;
+
+typedef struct {
+	BitIOBackend backend;
+	BitIO * io;
+	BitIORing ring;
+	bool input;
+	bool registered;  // Buffers are registered, use the *_FIXED operations
+	bool seekable;  // Several requests can be in flight at explicit offsets
+	bool eof;
+	unsigned depth, in_flight;
+	off_t offset;  // File offset of the next queued request
+	off_t delivered_offset;  // File offset of the data in the current input buffer
+	uint64_t next_seq, deliver_seq;
+	size_t buffer_size;
+	size_t current;
+	BitIOURingBuffer buffers[BIT_IO_URING_BUFFERS];
+} BitIOURingState;
+
+static bool
+ring_init(BitIORing * ring, unsigned entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0)
+		return false;
+	*ring = (BitIORing) {
+		.fd = fd,
+		.sq_entries = params.sq_entries,
+		.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned),
+		.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe),
+		.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe),
+		.current_position = params.features & IORING_FEAT_RW_CUR_POS,
+	};
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ring->cq_ptr = single_mmap ? ring->sq_ptr : mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		if (ring->sq_ptr != MAP_FAILED)
+			munmap(ring->sq_ptr, ring->sq_size);
+		if (!single_mmap && ring->cq_ptr != MAP_FAILED)
+			munmap(ring->cq_ptr, ring->cq_size);
+		if (ring->sqes != MAP_FAILED)
+			munmap(ring->sqes, ring->sqes_size);
+		close(fd);
+		return false;
+	}
+	uint8_t * sq = ring->sq_ptr;
+	uint8_t * cq = ring->cq_ptr;
+	ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+	ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+	return true;
+}
+
+static void
+ring_destroy(BitIORing * ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+static int
+ring_enter(BitIORing * ring, unsigned to_submit, unsigned min_complete)
+{
+	while (true) {
+		int result = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (result >= 0 || errno != EINTR)
+			return result;
+	}
+}
+
+// Kernels without the probe (before 5.6) don't have plain reads and writes either
+static bool
+ring_supports(BitIORing * ring, const uint8_t * opcodes, size_t count)
+{
+	struct io_uring_probe * probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+	if (!probe)
+		return false;
+	bool supported = !syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256);
+	for (size_t i = 0; supported && i < count; ++i)
+		supported = opcodes[i] < probe->ops_len && (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return supported;
+}
+
+// Submits a single request, the queue is much deeper than the number of buffers so it never fills up
+static void
+ring_submit(BitIORing * ring, const struct io_uring_sqe * request)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned index = tail & *ring->sq_mask;
+	ring->sqes[index] = *request;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	if (ring_enter(ring, 1, 0) < 0) {
+		fprintf(stderr, "Failed to submit io_uring request\n");
+		exit(1);
+	}
+}
+
+static void
+uring_submit_buffer(BitIOURingState * state, size_t index)
+{
+	BitIOURingBuffer * buffer = &state->buffers[index];
+	struct io_uring_sqe request;
+	memset(&request, 0, sizeof(request));
+	if (state->input)
+		request.opcode = state->registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	else
+		request.opcode = state->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	request.fd = state->io->fd;
+	request.addr = (uintptr_t) (buffer->data + buffer->start);
+	request.len = buffer->length;
+	request.off = state->seekable ? (uint64_t) buffer->offset : state->ring.current_position ? (uint64_t) -1 : 0;
+	request.buf_index = index;
+	request.user_data = index;
+	buffer->state = URBUF_IN_FLIGHT;
+	++state->in_flight;
+	ring_submit(&state->ring, &request);
+}
+
+// Submits queued buffers in stream order while there is room in flight
+static void
+uring_pump(BitIOURingState * state)
+{
+	while (state->in_flight < state->depth) {
+		size_t next = BIT_IO_URING_BUFFERS;
+		for (size_t i = 0; i < BIT_IO_URING_BUFFERS; ++i) {
+			if (state->buffers[i].state == URBUF_QUEUED && (next == BIT_IO_URING_BUFFERS || state->buffers[i].seq < state->buffers[next].seq))
+				next = i;
+		}
+		if (next == BIT_IO_URING_BUFFERS)
+			return;
+		uring_submit_buffer(state, next);
+	}
+}
+
+static void
+uring_reap(BitIOURingState * state, bool wait)
+{
+	BitIORing * ring = &state->ring;
+	unsigned head = *ring->cq_head;
+	if (wait && head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		if (ring_enter(ring, 0, 1) < 0) {
+			fprintf(stderr, "Failed to wait for io_uring completion\n");
+			exit(1);
+		}
+	}
+	for (; head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE); ++head) {
+		struct io_uring_cqe * completion = &ring->cqes[head & *ring->cq_mask];
+		if (completion->user_data == BIT_IO_URING_CANCEL_USER_DATA)
+			continue;
+		BitIOURingBuffer * buffer = &state->buffers[completion->user_data];
+		buffer->result = completion->res;
+		buffer->state = URBUF_DONE;
+		--state->in_flight;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void
+uring_queue_buffer(BitIOURingState * state, size_t index, size_t start, size_t length)
+{
+	BitIOURingBuffer * buffer = &state->buffers[index];
+	buffer->start = start;
+	buffer->length = length;
+	buffer->offset = state->offset;
+	buffer->seq = state->next_seq++;
+	buffer->state = URBUF_QUEUED;
+	state->offset += length;
+}
+
+// Retries interrupted requests and the rest of short writes, returns whether the buffer is finished
+static bool
+uring_retry_if_needed(BitIOURingState * state, BitIOURingBuffer * buffer)
+{
+	if (buffer->result == -EINTR || buffer->result == -EAGAIN) {
+		buffer->state = URBUF_QUEUED;
+		return false;
+	}
+	if (buffer->result < 0) {
+		fprintf(stderr, state->input ? "Failed to read input\n" : "Failed to write output\n");
+		exit(1);
+	}
+	if (!state->input && (size_t) buffer->result < buffer->length) {
+		buffer->start += buffer->result;
+		buffer->length -= buffer->result;
+		buffer->offset += buffer->result;
+		buffer->state = URBUF_QUEUED;
+		return false;
+	}
+	return true;
+}
+
+static BitIOURingState *
+uring_state_new(BitIO * io, BitBuffer * buf, bool input)
+{
+	BitIOURingState * state = calloc(1, sizeof(BitIOURingState));
+	if (!state) {
+		fprintf(stderr, "Failed to allocate io_uring state\n");
+		exit(1);
+	}
+	if (!ring_init(&state->ring, 4 * BIT_IO_URING_BUFFERS)) {
+		free(state);
+		return NULL;
+	}
+	// Whether the buffers can be registered is only known later, so both forms have to be there
+	static const uint8_t input_opcodes[] = {IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_ASYNC_CANCEL};
+	static const uint8_t output_opcodes[] = {IORING_OP_WRITE, IORING_OP_WRITE_FIXED};
+	bool supported = input ? ring_supports(&state->ring, input_opcodes, sizeof(input_opcodes)) : ring_supports(&state->ring, output_opcodes, sizeof(output_opcodes));
+	if (!supported) {
+		ring_destroy(&state->ring);
+		free(state);
+		return NULL;
+	}
+	state->backend = *io->backend;
+	// Reads are queued ahead at their own offsets
+	state->backend.skip = NULL;
+	state->io = io;
+	state->input = input;
+	state->buffer_size = buf->byte_size;
+	struct stat st;
+	int flags = fcntl(io->fd, F_GETFL);
+	off_t offset = lseek(io->fd, 0, SEEK_CUR);
+	// Appending writes and streams have to go one at a time to stay in order
+	state->seekable = !fstat(io->fd, &st) && S_ISREG(st.st_mode) && offset >= 0 && flags >= 0 && !(flags & O_APPEND);
+	state->offset = state->seekable ? offset : 0;
+	state->delivered_offset = state->offset;
+	state->depth = state->seekable ? BIT_IO_URING_BUFFERS - 1 : 1;
+	struct iovec iovecs[BIT_IO_URING_BUFFERS];
+	for (size_t i = 0; i < BIT_IO_URING_BUFFERS; ++i) {
+		uint8_t * data = i ? malloc(state->buffer_size) : buf->data;
+		if (!data) {
+			fprintf(stderr, "Failed to allocate IO buffer!\n");
+			exit(1);
+		}
+		state->buffers[i] = (BitIOURingBuffer) {
+			.data = data,
+			.state = i ? URBUF_FREE : URBUF_CURRENT,
+		};
+		iovecs[i] = (struct iovec) {.iov_base = data, .iov_len = state->buffer_size};
+	}
+	state->current = 0;
+	// Registering pins the pages, which may exceed RLIMIT_MEMLOCK, plain requests work without it
+	state->registered = !syscall(__NR_io_uring_register, state->ring.fd, IORING_REGISTER_BUFFERS, iovecs, BIT_IO_URING_BUFFERS);
+	// The pool is fixed, so the buffers can't grow anymore
+	buf->max_byte_size = buf->byte_size;
+	return state;
+}
+
+static void
+uring_state_delete(BitIOURingState * state)
+{
+	ring_destroy(&state->ring);
+	for (size_t i = 0; i < BIT_IO_URING_BUFFERS; ++i) {
+		// The current buffer is still owned by the BitIO
+		if (i != state->current)
+			free(state->buffers[i].data);
+	}
+	free(state);
+}
+
+// Input: every free buffer gets a read queued, buffers are handed to the interpreter in stream order
+
+static size_t
+uring_swap_in(BitIO * io)
+{
+	BitIOURingState * state = io->backend_data;
+	state->delivered_offset += io->in_buffer.io_length;
+	io->in_buffer.used_bits = 0;
+	io->in_buffer.io_length = 0;
+	if (state->eof)
+		return 0;
+	uring_queue_buffer(state, state->current, 0, state->buffer_size);
+	BitIOURingBuffer * next = NULL;
+	while (!next) {
+		for (size_t i = 0; i < BIT_IO_URING_BUFFERS; ++i) {
+			if (state->buffers[i].seq == state->deliver_seq && state->buffers[i].state == URBUF_DONE) {
+				if (uring_retry_if_needed(state, &state->buffers[i])) {
+					state->current = i;
+					next = &state->buffers[i];
+				}
+				break;
+			}
+		}
+		uring_pump(state);
+		if (!next)
+			uring_reap(state, true);
+	}
+	++state->deliver_seq;
+	next->state = URBUF_CURRENT;
+	size_t read_bytes = next->result;
+	// For a regular file anything short means the end, the reads queued after it are past the end
+	if (!read_bytes || (state->seekable && read_bytes < next->length))
+		state->eof = true;
+	io->in_buffer.data = next->data;
+	io->in_buffer.io_length = read_bytes;
+	return read_bytes;
+}
+
+static void
+uring_cancel_and_wait(BitIOURingState * state)
+{
+	for (size_t i = 0; i < BIT_IO_URING_BUFFERS; ++i) {
+		if (state->buffers[i].state != URBUF_IN_FLIGHT)
+			continue;
+		struct io_uring_sqe request;
+		memset(&request, 0, sizeof(request));
+		request.opcode = IORING_OP_ASYNC_CANCEL;
+		request.fd = -1;
+		request.addr = i;
+		request.user_data = BIT_IO_URING_CANCEL_USER_DATA;
+		ring_submit(&state->ring, &request);
+	}
+	while (state->in_flight)
+		uring_reap(state, true);
+}
+
+static void
+uring_close_input(BitIO * io)
+{
+	BitIOURingState * state = io->backend_data;
+	uring_cancel_and_wait(state);
+	if (state->seekable) {
+		// Leave the file offset right after the consumed input, as reading would have
+		off_t consumed = (io->in_buffer.used_bits - io->in_acc.count) >> 3;
+		lseek(io->fd, state->delivered_offset + consumed, SEEK_SET);
+	}
+	uring_state_delete(state);
+}
+
+bool
+bit_io_start_uring_input(BitIO * io)
+{
+	// A FILE may already hold buffered input, so only plain file descriptors qualify
+	if (io->file || io->fd < 0 || io->in_mapped || io->backend->swap_in)
+		return false;
+	BitIOURingState * state = uring_state_new(io, &io->in_buffer, true);
+	if (!state)
+		return false;
+	state->backend.swap_in = &uring_swap_in;
+	state->backend.close = &uring_close_input;
+	for (size_t i = 1; i < BIT_IO_URING_BUFFERS; ++i)
+		uring_queue_buffer(state, i, 0, state->buffer_size);
+	uring_pump(state);
+	io->backend = &state->backend;
+	io->backend_data = state;
+	return true;
+}
+
+// Output: full buffers are queued for writing, the interpreter continues in any free one
+
+static size_t
+uring_take_free_buffer(BitIOURingState * state)
+{
+	while (true) {
+		// Requeue every unfinished write first, one left done would be overtaken by the later ones
+		for (size_t i = 0; i < BIT_IO_URING_BUFFERS; ++i) {
+			BitIOURingBuffer * buffer = &state->buffers[i];
+			if (buffer->state == URBUF_DONE && uring_retry_if_needed(state, buffer))
+				buffer->state = URBUF_FREE;
+		}
+		for (size_t i = 0; i < BIT_IO_URING_BUFFERS; ++i) {
+			if (state->buffers[i].state == URBUF_FREE) {
+				state->buffers[i].state = URBUF_CURRENT;
+				return i;
+			}
+		}
+		uring_pump(state);
+		uring_reap(state, true);
+	}
+}
+
+static void
+uring_swap_out(BitIO * io, const uint8_t * ptr, size_t length)
+{
+	BitIOURingState * state = io->backend_data;
+	BitBuffer * buf = &io->out_buffer;
+	size_t finished_bytes = buf->used_bits >> 3;
+	uint8_t unfinished_byte = buf->data[finished_bytes < buf->byte_size ? finished_bytes : 0];
+	if (finished_bytes > buf->io_length) {
+		uring_queue_buffer(state, state->current, buf->io_length, finished_bytes - buf->io_length);
+		uring_pump(state);
+		state->current = uring_take_free_buffer(state);
+	}
+	// ptr belongs to the caller, so it has to be copied before returning
+	while (length) {
+		size_t advance = length > state->buffer_size ? state->buffer_size : length;
+		memcpy(state->buffers[state->current].data, ptr, advance);
+		uring_queue_buffer(state, state->current, 0, advance);
+		uring_pump(state);
+		state->current = uring_take_free_buffer(state);
+		ptr += advance;
+		length -= advance;
+	}
+	buf->data = state->buffers[state->current].data;
+	buf->data[0] = unfinished_byte;
+	buf->used_bits &= 7;
+	buf->io_length = 0;
+}
+
+static void
+uring_close_output(BitIO * io)
+{
+	BitIOURingState * state = io->backend_data;
+	while (true) {
+		bool pending = false;
+		for (size_t i = 0; i < BIT_IO_URING_BUFFERS; ++i) {
+			BitIOURingBuffer * buffer = &state->buffers[i];
+			if (buffer->state == URBUF_DONE && uring_retry_if_needed(state, buffer))
+				buffer->state = URBUF_FREE;
+			pending = pending || buffer->state == URBUF_QUEUED || buffer->state == URBUF_IN_FLIGHT;
+		}
+		if (!pending)
+			break;
+		uring_pump(state);
+		uring_reap(state, true);
+	}
+	if (state->seekable)
+		lseek(io->fd, state->offset, SEEK_SET);
+	uring_state_delete(state);
+}
+
+bool
+bit_io_start_uring_output(BitIO * io)
+{
+	if (io->file || io->fd < 0 || io->backend->swap_out)
+		return false;
+	BitIOURingState * state = uring_state_new(io, &io->out_buffer, false);
+	if (!state)
+		return false;
+	state->backend.swap_out = &uring_swap_out;
+	state->backend.close = &uring_close_output;
+	io->backend = &state->backend;
+	io->backend_data = state;
+	return true;
+}
+
+#else
+
+bool
+bit_io_start_uring_input(BitIO * io)
+{
+	(void) io;
+	return false;
+}
+
+bool
+bit_io_start_uring_output(BitIO * io)
+{
+	(void) io;
+	return false;
+}
+
+#endif
@@ -2,44 +2,134 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <endian.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "bitio.h"
 #include "functions.h"
 #include "expression.h"
+#include "bytecode.h"
+#include "native.h"
 #ifdef LEXER_ONLY
 #include "lexer.h"
 #else
 #include "parser.h"
 #endif
 
+enum engine {
+	ENGINE_TREE,
+	ENGINE_BYTECODE,
+	ENGINE_NATIVE,
+};
+
+typedef struct {
+	enum engine engine;
+	size_t in_buffer_size, out_buffer_size;
+	size_t max_buffer_size;  // Buffers grow up to this size while the streams keep them full
+	bool map_input;
+	bool use_stdio;
+	bool use_threads;
+	bool use_uring;
+} RunOptions;
+
+static BitIO *exit_output;  // Set while a program runs
+
+// Errors exit from wherever they happen, this keeps what the program wrote before one
+static void
+flush_output_at_exit(void)
+{
+	BitIO * io = exit_output;
+	if (!io)
+		return;
+	exit_output = NULL;
+	bit_io_flush(io);
+	// Waits for the writes still in flight in a thread or io_uring
+	free_bit_io(*io);
+}
+
 void
-run_program(const ExprNode * program)
+run_program(const ExprNode * program, const ScopeLayout * root_layout, const RunOptions * options)
 {
-	BitIO io_in = file_to_bit_io(stdin, 16, 0);
-	BitIO io_out = file_to_bit_io(stdout, 0, 16);
+	BitIO io_in, io_out;
+	if (options->use_stdio) {
+		io_in = file_to_bit_io(stdin, options->in_buffer_size, 0);
+		io_out = file_to_bit_io(stdout, 0, options->out_buffer_size);
+	} else {
+		io_in = fd_to_bit_io(STDIN_FILENO, options->in_buffer_size, 0);
+		io_out = fd_to_bit_io(STDOUT_FILENO, 0, options->out_buffer_size);
+	}
+	bit_io_set_max_buffer_sizes(&io_in, options->max_buffer_size, 0);
+	bit_io_set_max_buffer_sizes(&io_out, 0, options->max_buffer_size);
+	if (options->map_input)
+		bit_io_map_input(&io_in);
+	// Without io_uring the threads (if asked for) or blocking calls take over
+	if (options->use_uring) {
+		bit_io_start_uring_input(&io_in);
+		bit_io_start_uring_output(&io_out);
+	}
+	if (options->use_threads) {
+		bit_io_start_prefetch(&io_in);
+		bit_io_start_write_behind(&io_out);
+	}
+	static bool exit_hooked;
+	if (!exit_hooked)
+		exit_hooked = !atexit(&flush_output_at_exit);
+	exit_output = &io_out;
 
 	InterpContext ctx = {
 		.io_in = &io_in,
 		.io_out = &io_out,
-		.scope = {NULL, NULL},
-		.user_functions = NULL,
+		.scope = NULL,
+		.user_functions = {NULL, 0, 0},
+		.frames = NULL,
 	};
-
-	evaluate_expression(&ctx, program);
+	switch (options->engine) {
+	case ENGINE_TREE:
+		scope_push(&ctx, root_layout);
+		evaluate_expression(&ctx, program);
+		scope_pop(&ctx);
+		break;
+	case ENGINE_BYTECODE: {
+		BytecodeProgram * bytecode = compile_bytecode(program);
+		scope_push(&ctx, root_layout);
+		run_bytecode(&ctx, bytecode);
+		scope_pop(&ctx);
+		free_bytecode(bytecode);
+	} break;
+	case ENGINE_NATIVE:
+		// The compiled program pushes a root scope of its own layout
+		run_native(&ctx, program, root_layout);
+		break;
+	}
+	exit_output = NULL;
 	bit_io_flush(&io_out);
 	free_bit_io(io_in);
 	free_bit_io(io_out);
-	scope_clear(&ctx.scope);
-	userfunclist_clear(ctx.user_functions);
+	free_evaluate_frames(&ctx);
+	scope_pool_clear(&ctx);
+	userfunclist_clear(&ctx.user_functions);
 }
 
 void
-dump_ast(const ExprNode * program)
+dump_ast(const ExprNode * program, const ScopeLayout * root_layout, const RunOptions * options)
 {
-	FileTreePrinter printer;
-	init_file_tree_printer(&printer, stdout);
-	print_expression(&printer.as_tree_printer, program);
+	switch (options->engine) {
+	case ENGINE_TREE: {
+		FileTreePrinter printer;
+		init_file_tree_printer(&printer, stdout);
+		print_expression(&printer.as_tree_printer, program);
+	} break;
+	case ENGINE_BYTECODE: {
+		BytecodeProgram * bytecode = compile_bytecode(program);
+		print_bytecode(stdout, bytecode);
+		free_bytecode(bytecode);
+	} break;
+	case ENGINE_NATIVE:
+		emit_c(stdout, program, root_layout);
+		break;
+	}
 }
 
 enum main_action {
@@ -47,20 +137,127 @@ enum main_action {
 	MAINACT_DUMP,
 };
 
+static void
+print_usage(const char * argv0)
+{
+	fprintf(stderr, "Usage: %s [options] <code>\n", argv0);
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -d, --dump             Print the parsed program (or its bytecode or C) instead of running it\n");
+	fprintf(stderr, "  --emit-c               Print the program as C, like -d -e native\n");
+	fprintf(stderr, "  -e, --engine ENGINE    Run the program with ENGINE: tree (walk the parsed program, default), bytecode\n");
+	fprintf(stderr, "                         or native (build it as C with $CC, cached in $BITSTREAMOP_CACHE_DIR)\n");
+	fprintf(stderr, "  --no-optimize          Keep the program as parsed, without folding constants or dropping dead code\n");
+	fprintf(stderr, "  --no-inline            Keep calls of small user functions instead of copying their bodies in\n");
+	fprintf(stderr, "  -i, --in-buffer SIZE   Initial input buffer size (default: page size)\n");
+	fprintf(stderr, "  -o, --out-buffer SIZE  Initial output buffer size (default: page size)\n");
+	fprintf(stderr, "  -m, --max-buffer SIZE  Let buffers grow up to SIZE while streaming (default: 1M, 0 to disable)\n");
+	fprintf(stderr, "  --no-mmap              Read regular files through the input buffer instead of mapping them\n");
+	fprintf(stderr, "  --stdio                Go through stdio instead of reading and writing the file descriptors directly\n");
+	fprintf(stderr, "  -t, --threads          Read ahead and write behind in background threads\n");
+	fprintf(stderr, "  --uring                Keep several reads and writes in flight with io_uring where available\n");
+	fprintf(stderr, "SIZE may have a K, M or G suffix\n");
+}
+
+static size_t
+parse_size(const char * argv0, const char * option, const char * s)
+{
+	char *endptr;
+	// strtoull would skip spaces and take a sign, negating the value
+	errno = 0;
+	unsigned long long size = strtoull(s, &endptr, 10);
+	unsigned shift = 0;
+	switch (*endptr) {
+	case 'g':
+	case 'G':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'm':
+	case 'M':
+		shift += 10;
+		/* FALLTHROUGH */
+	case 'k':
+	case 'K':
+		shift += 10;
+		++endptr;
+		break;
+	}
+	if (*s < '0' || *s > '9' || errno == ERANGE || *endptr || size > SIZE_MAX >> shift) {
+		fprintf(stderr, "Invalid size for %s: %s\n", option, s);
+		print_usage(argv0);
+		exit(1);
+	}
+	return size << shift;
+}
+
 int
 main(int argc, char ** argv)
 {
+	const char * argv0 = argc ? argv[0] : "bitstreamop";
 	char * code = NULL;
 	enum main_action main_action = MAINACT_RUN;
-	if (argc < 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
-		fprintf(stderr, "Usage: %s [-d] <code>\n", argc ? argv[0] : "bitstreamop");
-		return 1;
+	bool optimize = true;
+	bool inline_functions = true;
+	long page_size = sysconf(_SC_PAGESIZE);
+	RunOptions run_options = {
+		.in_buffer_size = page_size > 0 ? page_size : 4096,
+		.out_buffer_size = page_size > 0 ? page_size : 4096,
+		.max_buffer_size = 1 << 20,
+		.map_input = true,
+	};
+	int argi = 1;
+	for (; argi < argc; ++argi) {
+		const char * arg = argv[argi];
+		if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+			print_usage(argv0);
+			return 1;
+		} else if (!strcmp(arg, "-d") || !strcmp(arg, "--dump")) {
+			main_action = MAINACT_DUMP;
+		} else if (!strcmp(arg, "--emit-c")) {
+			main_action = MAINACT_DUMP;
+			run_options.engine = ENGINE_NATIVE;
+		} else if (argi + 1 < argc && (!strcmp(arg, "-e") || !strcmp(arg, "--engine"))) {
+			const char * engine = argv[++argi];
+			if (!strcmp(engine, "tree")) {
+				run_options.engine = ENGINE_TREE;
+			} else if (!strcmp(engine, "bytecode")) {
+				run_options.engine = ENGINE_BYTECODE;
+			} else if (!strcmp(engine, "native")) {
+				run_options.engine = ENGINE_NATIVE;
+			} else {
+				fprintf(stderr, "Unknown engine: %s\n", engine);
+				print_usage(argv0);
+				return 1;
+			}
+		} else if (!strcmp(arg, "--no-optimize")) {
+			optimize = false;
+		} else if (!strcmp(arg, "--no-inline")) {
+			inline_functions = false;
+		} else if (argi + 1 < argc && (!strcmp(arg, "-i") || !strcmp(arg, "--in-buffer"))) {
+			run_options.in_buffer_size = parse_size(argv0, arg, argv[++argi]);
+		} else if (argi + 1 < argc && (!strcmp(arg, "-o") || !strcmp(arg, "--out-buffer"))) {
+			run_options.out_buffer_size = parse_size(argv0, arg, argv[++argi]);
+		} else if (argi + 1 < argc && (!strcmp(arg, "-m") || !strcmp(arg, "--max-buffer"))) {
+			run_options.max_buffer_size = parse_size(argv0, arg, argv[++argi]);
+		} else if (!strcmp(arg, "--no-mmap")) {
+			run_options.map_input = false;
+		} else if (!strcmp(arg, "--stdio")) {
+			run_options.use_stdio = true;
+		} else if (!strcmp(arg, "-t") || !strcmp(arg, "--threads")) {
+			run_options.use_threads = true;
+		} else if (!strcmp(arg, "--uring")) {
+			run_options.use_uring = true;
+		} else if (!strcmp(arg, "--")) {
+			++argi;
+			break;
+		} else {
+			break;
+		}
 	}
-	code = argv[1];
-	if (argc > 2 && (!strcmp(argv[1], "-d") || !strcmp(argv[1], "--dump"))) {
-		main_action = MAINACT_DUMP;
-		code = argv[2];
+	if (argi != argc - 1) {
+		print_usage(argv0);
+		return 1;
 	}
+	code = argv[argi];
 
 #ifdef LEXER_ONLY
 	Lexer * lexer = lexer_new();
@@ -77,14 +274,16 @@ main(int argc, char ** argv)
 	lexer_delete(lexer);
 #else
 	Parser * parser = parser_new();
+	parser_set_optimize(parser, optimize);
+	parser_set_inline(parser, inline_functions);
 	parser_feed(parser, code, strlen(code));
 	const ExprNode * parsed_program = parser_end(parser);
 	switch (main_action) {
 	case MAINACT_RUN:
-		run_program(parsed_program);
+		run_program(parsed_program, parser_root_layout(parser), &run_options);
 		break;
 	case MAINACT_DUMP:
-		dump_ast(parsed_program);
+		dump_ast(parsed_program, parser_root_layout(parser), &run_options);
 		break;
 	}
 	parser_delete(parser);
@@ -0,0 +1,582 @@
+#include "bytecode.h"
+#include "functions.h"
+#include "common.h"
+
+#include <string.h>
+
+__attribute__((noreturn)) static void
+die(char * msg)
+{
+	fprintf(stderr, "Error: %s\n", msg);
+	exit(1);
+}
+
+static void *
+grow_array(void * array, size_t * capacity, size_t needed, size_t item_size)
+{
+	if (needed <= *capacity)
+		return array;
+	size_t new_capacity = *capacity ? *capacity : 16;
+	while (new_capacity < needed)
+		new_capacity <<= 1;
+	void * new_array = realloc(array, new_capacity * item_size);
+	if (!new_array)
+		die("Failed to allocate bytecode");
+	*capacity = new_capacity;
+	return new_array;
+}
+
+// Compiler: every expression leaves its value in a register chosen by the parent, temporaries are
+// allocated above it in stack order
+
+typedef struct {
+	BytecodeProgram *program;
+	size_t function_capacity, constant_capacity, name_capacity, variable_capacity, layout_capacity, switch_capacity;
+} BytecodeCompiler;
+
+typedef struct {
+	BytecodeCompiler *compiler;
+	BytecodeInsn *code;
+	size_t length, capacity;
+	uint32_t next_register, register_count;
+} BytecodeBuilder;
+
+static uint32_t
+emit(BytecodeBuilder * builder, uint32_t op, uint32_t dst, uint32_t a, uint32_t b)
+{
+	builder->code = grow_array(builder->code, &builder->capacity, builder->length + 1, sizeof(BytecodeInsn));
+	builder->code[builder->length] = (BytecodeInsn) {.op = op, .dst = dst, .a = a, .b = b};
+	return builder->length++;
+}
+
+static uint32_t
+alloc_registers(BytecodeBuilder * builder, uint32_t count)
+{
+	uint32_t first = builder->next_register;
+	builder->next_register += count;
+	if (builder->next_register > builder->register_count)
+		builder->register_count = builder->next_register;
+	return first;
+}
+
+static void
+free_registers(BytecodeBuilder * builder, uint32_t first)
+{
+	builder->next_register = first;
+}
+
+static uint32_t
+add_constant(BytecodeCompiler * compiler, WidthInteger value)
+{
+	BytecodeProgram * program = compiler->program;
+	for (size_t i = 0; i < program->constant_count; ++i) {
+		if (program->constants[i].value == value.value && program->constants[i].width == value.width)
+			return i;
+	}
+	program->constants = grow_array(program->constants, &compiler->constant_capacity, program->constant_count + 1, sizeof(WidthInteger));
+	program->constants[program->constant_count] = value;
+	return program->constant_count++;
+}
+
+static uint32_t
+add_name(BytecodeCompiler * compiler, const char * name)
+{
+	BytecodeProgram * program = compiler->program;
+	for (size_t i = 0; i < program->name_count; ++i) {
+		if (!strcmp(program->names[i], name))
+			return i;
+	}
+	program->names = grow_array(program->names, &compiler->name_capacity, program->name_count + 1, sizeof(char *));
+	program->names[program->name_count] = name;
+	return program->name_count++;
+}
+
+static uint32_t
+add_variable(BytecodeCompiler * compiler, const VariableResolution * variable)
+{
+	BytecodeProgram * program = compiler->program;
+	program->variables = grow_array(program->variables, &compiler->variable_capacity, program->variable_count + 1, sizeof(VariableResolution *));
+	program->variables[program->variable_count] = variable;
+	return program->variable_count++;
+}
+
+static uint32_t
+add_layout(BytecodeCompiler * compiler, const ScopeLayout * layout)
+{
+	BytecodeProgram * program = compiler->program;
+	program->layouts = grow_array(program->layouts, &compiler->layout_capacity, program->layout_count + 1, sizeof(ScopeLayout *));
+	program->layouts[program->layout_count] = layout;
+	return program->layout_count++;
+}
+
+static uint32_t
+add_switch(BytecodeCompiler * compiler, const SwitchExprNode * node)
+{
+	BytecodeProgram * program = compiler->program;
+	uint32_t * targets = calloc(node->case_count + 1, sizeof(uint32_t));
+	if (!targets)
+		die("Failed to allocate bytecode");
+	program->switches = grow_array(program->switches, &compiler->switch_capacity, program->switch_count + 1, sizeof(BytecodeSwitch));
+	program->switches[program->switch_count] = (BytecodeSwitch) {
+		.node = node,
+		.targets = targets,
+	};
+	return program->switch_count++;
+}
+
+// Scopes without slots are elided, like scope_enter does
+static void
+emit_scope_push(BytecodeBuilder * builder, const ScopeLayout * layout)
+{
+	if (layout->slot_count)
+		emit(builder, BCOP_SCOPE_PUSH, 0, add_layout(builder->compiler, layout), 0);
+}
+
+static void
+emit_scope_pop(BytecodeBuilder * builder, const ScopeLayout * layout)
+{
+	if (layout->slot_count)
+		emit(builder, BCOP_SCOPE_POP, 0, 0, 0);
+}
+
+static uint32_t compile_function(BytecodeCompiler * compiler, const ExprNode * body, const ExprNode * def);
+
+static void
+compile_expression(BytecodeBuilder * builder, const ExprNode * expr, uint32_t dst)
+{
+	BytecodeCompiler * compiler = builder->compiler;
+	if (!expr) {
+		// The parser may leave out an unfinished last operand
+		emit(builder, BCOP_DIE, 0, add_name(compiler, "Incomplete expression"), 0);
+		return;
+	}
+	switch (expr->node_type) {
+	case EXPRNODE_FunctionApplication: {
+		const FunctionApplicationExprNode * self = &expr->as_FunctionApplication;
+		if (!self->func || self->arg_count != self->func->args_def.length) {
+			emit(builder, BCOP_DIE, 0, add_name(compiler, "Wrong argument count"), 0);
+			break;
+		}
+		uint32_t args = alloc_registers(builder, self->arg_count);
+		for (uint64_t i = 0; i < self->arg_count; ++i)
+			compile_expression(builder, &self->args[i], args + i);
+		emit(builder, self->func - function_table.entries, dst, args, 0);
+		free_registers(builder, args);
+	} break;
+	case EXPRNODE_ShortCircuit: {
+		const ShortCircuitExprNode * self = &expr->as_ShortCircuit;
+		// The first operand's truth is the result when it decides it, the jump skips the second one then
+		compile_expression(builder, &self->args[0], dst);
+		emit(builder, BCOP_TRUTH, dst, dst, 0);
+		uint32_t skip_jump = emit(builder, self->is_or ? BCOP_JUMP_NONZERO : BCOP_JUMP_ZERO, dst, 0, 0);
+		compile_expression(builder, &self->args[1], dst);
+		emit(builder, BCOP_TRUTH, dst, dst, 0);
+		builder->code[skip_jump].a = builder->length;
+	} break;
+	case EXPRNODE_Literal:
+		emit(builder, BCOP_LOADK, dst, add_constant(compiler, expr->as_Literal.value), 0);
+		break;
+	case EXPRNODE_Assign:
+		compile_expression(builder, expr->as_Assign.rhs, dst);
+		emit(builder, BCOP_ASSIGN, dst, expr->as_Assign.slot, 0);
+		break;
+	case EXPRNODE_Reassign:
+		compile_expression(builder, expr->as_Reassign.rhs, dst);
+		emit(builder, BCOP_REASSIGN, dst, add_variable(compiler, &expr->as_Reassign.resolution), expr->as_Reassign.root_slot);
+		break;
+	case EXPRNODE_Variable:
+		emit(builder, BCOP_LOADVAR, dst, add_variable(compiler, &expr->as_Variable.resolution), 0);
+		break;
+	case EXPRNODE_StatementList: {
+		const StatementListExprNode * self = &expr->as_StatementList;
+		if (!self->length)
+			emit(builder, BCOP_LOADK, dst, add_constant(compiler, (WidthInteger) {0, 0}), 0);
+		// Only the last value is kept, so they can all go to dst
+		for (uint64_t i = 0; i < self->length; ++i)
+			compile_expression(builder, &self->args[i], dst);
+	} break;
+	case EXPRNODE_LoopWhile: {
+		const LoopWhileExprNode * self = &expr->as_LoopWhile;
+		emit(builder, BCOP_LOADK, dst, add_constant(compiler, (WidthInteger) {0, 0}), 0);
+		emit_scope_push(builder, &self->layout);
+		uint32_t condition = alloc_registers(builder, 1);
+		uint32_t loop_start = builder->length;
+		compile_expression(builder, self->condition, condition);
+		uint32_t exit_jump = emit(builder, BCOP_JUMP_ZERO, condition, 0, 0);
+		compile_expression(builder, self->body, dst);
+		emit(builder, BCOP_JUMP, 0, loop_start, 0);
+		builder->code[exit_jump].a = builder->length;
+		emit_scope_pop(builder, &self->layout);
+		free_registers(builder, condition);
+	} break;
+	case EXPRNODE_LoopRepeat: {
+		const LoopRepeatExprNode * self = &expr->as_LoopRepeat;
+		emit(builder, BCOP_LOADK, dst, add_constant(compiler, (WidthInteger) {0, 0}), 0);
+		emit_scope_push(builder, &self->layout);
+		// The count, then the index
+		uint32_t counter = alloc_registers(builder, 2);
+		compile_expression(builder, self->count, counter);
+		emit(builder, BCOP_LOADK, counter + 1, add_constant(compiler, (WidthInteger) {0, 64}), 0);
+		uint32_t loop_start = emit(builder, BCOP_REPEAT, counter, 0, self->index_name ? self->index_slot + 1 : 0);
+		compile_expression(builder, self->body, dst);
+		emit(builder, BCOP_JUMP, 0, loop_start, 0);
+		builder->code[loop_start].a = builder->length;
+		emit_scope_pop(builder, &self->layout);
+		free_registers(builder, counter);
+	} break;
+	case EXPRNODE_CondIf: {
+		const CondIfExprNode * self = &expr->as_CondIf;
+		emit(builder, BCOP_LOADK, dst, add_constant(compiler, (WidthInteger) {0, 0}), 0);
+		emit_scope_push(builder, &self->layout);
+		uint32_t condition = alloc_registers(builder, 1);
+		compile_expression(builder, self->condition, condition);
+		uint32_t skip_jump = emit(builder, BCOP_JUMP_ZERO, condition, 0, 0);
+		compile_expression(builder, self->body, dst);
+		builder->code[skip_jump].a = builder->length;
+		emit_scope_pop(builder, &self->layout);
+		free_registers(builder, condition);
+	} break;
+	case EXPRNODE_Switch: {
+		const SwitchExprNode * self = &expr->as_Switch;
+		uint64_t body_count = self->case_count + self->has_default;
+		uint32_t table = add_switch(compiler, self);
+		uint32_t * end_jumps = calloc(body_count + 1, sizeof(uint32_t));
+		if (!end_jumps)
+			die("Failed to allocate bytecode");
+		emit(builder, BCOP_LOADK, dst, add_constant(compiler, (WidthInteger) {0, 0}), 0);
+		emit_scope_push(builder, &self->layout);
+		uint32_t value = alloc_registers(builder, 1);
+		compile_expression(builder, self->value, value);
+		emit(builder, BCOP_SWITCH, value, table, 0);
+		for (uint64_t i = 0; i < body_count; ++i) {
+			// Nested switches may move the table
+			compiler->program->switches[table].targets[i] = builder->length;
+			compile_expression(builder, &self->bodies[i], dst);
+			end_jumps[i] = emit(builder, BCOP_JUMP, 0, 0, 0);
+		}
+		if (!self->has_default)
+			compiler->program->switches[table].targets[self->case_count] = builder->length;
+		for (uint64_t i = 0; i < body_count; ++i)
+			builder->code[end_jumps[i]].a = builder->length;
+		emit_scope_pop(builder, &self->layout);
+		free_registers(builder, value);
+		free(end_jumps);
+	} break;
+	case EXPRNODE_UserFunctionCall: {
+		const UserFunctionCallExprNode * self = &expr->as_UserFunctionCall;
+		// The function is looked up before the arguments are evaluated, they follow it in registers
+		uint32_t func = alloc_registers(builder, 1 + self->arg_count);
+		emit(builder, BCOP_FIND_FUNC, func, add_name(compiler, self->name), self->arg_count);
+		for (uint64_t i = 0; i < self->arg_count; ++i)
+			compile_expression(builder, &self->args[i], func + 1 + i);
+		emit(builder, self->tail_layout ? BCOP_TAIL_CALL : BCOP_CALL, dst, func, 0);
+		free_registers(builder, func);
+	} break;
+	case EXPRNODE_InlinedCall: {
+		const InlinedCallExprNode * self = &expr->as_InlinedCall;
+		// Arguments are evaluated in the caller's scope, then bound like CALL binds them
+		uint32_t args = alloc_registers(builder, self->params.length);
+		for (uint64_t i = 0; i < self->params.length; ++i)
+			compile_expression(builder, &self->args[i], args + i);
+		emit_scope_push(builder, &self->layout);
+		for (uint64_t i = 0; i < self->params.length; ++i)
+			emit(builder, BCOP_ASSIGN, args + i, i, 0);
+		compile_expression(builder, self->body, dst);
+		emit_scope_pop(builder, &self->layout);
+		free_registers(builder, args);
+	} break;
+	case EXPRNODE_UserFunctionDef:
+		emit(builder, BCOP_DEFUN, 0, compile_function(compiler, expr->as_UserFunctionDef.body, expr), 0);
+		emit(builder, BCOP_LOADK, dst, add_constant(compiler, (WidthInteger) {0, 0}), 0);
+		break;
+	}
+}
+
+static uint32_t
+compile_function(BytecodeCompiler * compiler, const ExprNode * body, const ExprNode * def)
+{
+	BytecodeProgram * program = compiler->program;
+	// Reserved first, nested definitions are compiled while building this one
+	uint32_t index = program->function_count++;
+	program->functions = grow_array(program->functions, &compiler->function_capacity, program->function_count, sizeof(BytecodeFunction));
+	BytecodeBuilder builder = {
+		.compiler = compiler,
+		.code = NULL,
+		.length = 0,
+		.capacity = 0,
+		.next_register = 0,
+		.register_count = 0,
+	};
+	uint32_t result = alloc_registers(&builder, 1);
+	compile_expression(&builder, body, result);
+	emit(&builder, BCOP_RETURN, result, 0, 0);
+	program->functions[index] = (BytecodeFunction) {
+		.code = builder.code,
+		.length = builder.length,
+		.register_count = builder.register_count,
+		.def = def,
+	};
+	return index;
+}
+
+BytecodeProgram *
+compile_bytecode(const ExprNode * program_expr)
+{
+	BytecodeProgram * program = calloc(1, sizeof(BytecodeProgram));
+	if (!program)
+		die("Failed to allocate bytecode");
+	BytecodeCompiler compiler = {
+		.program = program,
+	};
+	compile_function(&compiler, program_expr, NULL);
+	// The functions don't move anymore, so their definitions can point at them
+	for (size_t i = 0; i < program->function_count; ++i) {
+		BytecodeFunction * function = &program->functions[i];
+		if (!function->def)
+			continue;
+		const UserFunctionDefExprNode * def = &function->def->as_UserFunctionDef;
+		function->definition = (struct userfunc_definition) {
+			.body = def->body,
+			.args_def = def->args,
+			.layout = &def->layout,
+			.code = function,
+		};
+	}
+	return program;
+}
+
+void
+free_bytecode(BytecodeProgram * program)
+{
+	for (size_t i = 0; i < program->function_count; ++i)
+		free(program->functions[i].code);
+	free(program->functions);
+	free(program->constants);
+	free(program->names);
+	free(program->variables);
+	free(program->layouts);
+	for (size_t i = 0; i < program->switch_count; ++i)
+		free(program->switches[i].targets);
+	free(program->switches);
+	free(program);
+}
+
+// VM: each call gets its registers above the caller's, the register file may move when it grows
+
+typedef struct {
+	const BytecodeFunction *function;
+	const BytecodeInsn *return_pc;
+	size_t base;
+	uint32_t dst;
+	const ScopeLayout *layout;  // Of the callee, which may be redefined while it runs
+} BytecodeCallFrame;
+
+WidthInteger
+run_bytecode(InterpContext * ctx, const BytecodeProgram * program)
+{
+	const BytecodeFunction * function = &program->functions[0];
+	size_t register_capacity = 0;
+	WidthInteger * registers = grow_array(NULL, &register_capacity, function->register_count, sizeof(WidthInteger));
+	size_t frame_capacity = 0, frame_count = 0;
+	BytecodeCallFrame * frames = NULL;
+	// Inline cache of FIND_FUNC by name, redefinitions update the nodes in place
+	struct userfunclist_node ** func_cache = calloc(program->name_count ? program->name_count : 1, sizeof(struct userfunclist_node *));
+	if (!func_cache)
+		die("Failed to allocate function cache");
+	size_t base = 0;
+	WidthInteger * r = registers;
+	const BytecodeInsn * pc = function->code;
+	while (true) {
+		const BytecodeInsn insn = *pc++;
+		switch (insn.op) {
+#define BITSTREAMOP_FUNCTION(name, effects, arglist, body) case BCOP_BUILTIN_##name: \
+			r[insn.dst] = funcimpl_##name(ctx, (Argtype_##name *) &r[insn.a]); \
+			break;
+#include "functions.cc"
+#undef BITSTREAMOP_FUNCTION
+		case BCOP_LOADK:
+			r[insn.dst] = program->constants[insn.a];
+			break;
+		case BCOP_MOVE:
+			r[insn.dst] = r[insn.a];
+			break;
+		case BCOP_TRUTH:
+			r[insn.dst] = (WidthInteger) {.value = (bool) r[insn.a].value, .width = 1};
+			break;
+		case BCOP_LOADVAR: {
+			WidthInteger *ptr = scope_find_variable(ctx->scope, program->variables[insn.a]);
+			if (!ptr)
+				die("Variable not found");
+			r[insn.dst] = *ptr;
+		} break;
+		case BCOP_ASSIGN:
+			scope_assign_slot(ctx->scope, insn.a, r[insn.dst]);
+			break;
+		case BCOP_REASSIGN: {
+			WidthInteger *ptr = scope_find_variable(ctx->scope, program->variables[insn.a]);
+			if (ptr)
+				*ptr = r[insn.dst];
+			else
+				scope_assign_slot(scope_find_root(ctx->scope), insn.b, r[insn.dst]);
+		} break;
+		case BCOP_SCOPE_PUSH:
+			scope_push(ctx, program->layouts[insn.a]);
+			break;
+		case BCOP_SCOPE_POP:
+			scope_pop(ctx);
+			break;
+		case BCOP_JUMP:
+			pc = function->code + insn.a;
+			break;
+		case BCOP_JUMP_ZERO:
+			if (!r[insn.dst].value)
+				pc = function->code + insn.a;
+			break;
+		case BCOP_JUMP_NONZERO:
+			if (r[insn.dst].value)
+				pc = function->code + insn.a;
+			break;
+		case BCOP_REPEAT: {
+			WidthInteger * counter = &r[insn.dst];
+			if (counter[1].value >= counter[0].value) {
+				pc = function->code + insn.a;
+				break;
+			}
+			if (insn.b)
+				scope_assign_slot(ctx->scope, insn.b - 1, counter[1]);
+			++counter[1].value;
+		} break;
+		case BCOP_SWITCH: {
+			const BytecodeSwitch * table = &program->switches[insn.a];
+			pc = function->code + table->targets[switch_find_case(table->node, r[insn.dst].value)];
+		} break;
+		case BCOP_DEFUN: {
+			const BytecodeFunction * defined = &program->functions[insn.a];
+			const UserFunctionDefExprNode * def = &defined->def->as_UserFunctionDef;
+			userfunclist_add_function(&ctx->user_functions, def->name, &defined->definition);
+		} break;
+		case BCOP_FIND_FUNC: {
+			struct userfunclist_node *node = func_cache[insn.a];
+			if (!node) {
+				node = userfunclist_find_function(&ctx->user_functions, program->names[insn.a]);
+				if (!node)
+					die("User function is not defined");
+				func_cache[insn.a] = node;
+			}
+			// The call keeps to this definition, even if its arguments redefine the function
+			const struct userfunc_definition *func = node->definition;
+			if (insn.b != func->args_def.length)
+				die("Wrong argument count");
+			r[insn.dst] = (WidthInteger) {.value = (uintptr_t) func, .width = 0};
+		} break;
+		case BCOP_TAIL_CALL: {
+			const struct userfunc_definition *func = (const struct userfunc_definition *) (uintptr_t) r[insn.a].value;
+			if (func->code == function) {
+				// No scope was pushed since the call began, so the current one is its own
+				for (uint64_t i = 0; i < func->args_def.length; ++i)
+					scope_assign_slot(ctx->scope, i, r[insn.a + 1 + i]);
+				pc = function->code;
+				break;
+			}
+		}
+		/* FALLTHROUGH */
+		case BCOP_CALL: {
+			const struct userfunc_definition *func = (const struct userfunc_definition *) (uintptr_t) r[insn.a].value;
+			scope_enter(ctx, func->layout);
+			for (uint64_t i = 0; i < func->args_def.length; ++i)
+				scope_assign_slot(ctx->scope, i, r[insn.a + 1 + i]);
+			frames = grow_array(frames, &frame_capacity, frame_count + 1, sizeof(BytecodeCallFrame));
+			frames[frame_count++] = (BytecodeCallFrame) {
+				.function = function,
+				.return_pc = pc,
+				.base = base,
+				.dst = insn.dst,
+				.layout = func->layout,
+			};
+			base += function->register_count;
+			function = func->code;
+			registers = grow_array(registers, &register_capacity, base + function->register_count, sizeof(WidthInteger));
+			r = registers + base;
+			pc = function->code;
+		} break;
+		case BCOP_RETURN: {
+			WidthInteger value = r[insn.dst];
+			if (!frame_count) {
+				free(registers);
+				free(frames);
+				free(func_cache);
+				return value;
+			}
+			BytecodeCallFrame * frame = &frames[--frame_count];
+			scope_leave(ctx, frame->layout);
+			function = frame->function;
+			pc = frame->return_pc;
+			base = frame->base;
+			r = registers + base;
+			r[frame->dst] = value;
+		} break;
+		case BCOP_DIE:
+			die((char *) program->names[insn.a]);
+		}
+	}
+}
+
+static const char *bytecode_core_op_names[] = {
+	"LOADK",
+	"MOVE",
+	"TRUTH",
+	"LOADVAR",
+	"ASSIGN",
+	"REASSIGN",
+	"SCOPE_PUSH",
+	"SCOPE_POP",
+	"JUMP",
+	"JUMP_ZERO",
+	"JUMP_NONZERO",
+	"REPEAT",
+	"SWITCH",
+	"DEFUN",
+	"FIND_FUNC",
+	"TAIL_CALL",
+	"CALL",
+	"RETURN",
+	"DIE",
+};
+
+void
+print_bytecode(FILE * file, const BytecodeProgram * program)
+{
+	for (size_t f = 0; f < program->function_count; ++f) {
+		const BytecodeFunction * function = &program->functions[f];
+		if (function->def)
+			fprintf(file, "function #%zu %s (%u registers):\n", f, function->def->as_UserFunctionDef.name, function->register_count);
+		else
+			fprintf(file, "main (%u registers):\n", function->register_count);
+		for (size_t i = 0; i < function->length; ++i) {
+			const BytecodeInsn * insn = &function->code[i];
+			const char * name = insn->op < function_table.length ? function_table.entries[insn->op].name : bytecode_core_op_names[insn->op - BCOP_LOADK];
+			fprintf(file, "%6zu  %-12s r%u, %u, %u", i, name, insn->dst, insn->a, insn->b);
+			switch (insn->op) {
+			case BCOP_LOADK:
+				fprintf(file, "  ; (value = %llu, width = %zu)", (unsigned long long) program->constants[insn->a].value, program->constants[insn->a].width);
+				break;
+			case BCOP_LOADVAR:
+			case BCOP_REASSIGN:
+				fprintf(file, "  ; %s", program->variables[insn->a]->name);
+				break;
+			case BCOP_SWITCH: {
+				const BytecodeSwitch * table = &program->switches[insn->a];
+				fprintf(file, "  ;");
+				for (uint64_t c = 0; c < table->node->case_count; ++c)
+					fprintf(file, " %llu->%u", (unsigned long long) table->node->labels[c], table->targets[c]);
+				fprintf(file, " else->%u", table->targets[table->node->case_count]);
+			} break;
+			case BCOP_FIND_FUNC:
+			case BCOP_DIE:
+				fprintf(file, "  ; %s", program->names[insn->a]);
+				break;
+			}
+			fprintf(file, "\n");
+		}
+	}
+}
@@ -0,0 +1,75 @@
+#ifndef BYTECODE_H_
+#define BYTECODE_H_
+
+#include "interp_types.h"
+#include "expression.h"
+
+// Builtins come first, so their opcode is their index in function_table
+enum bytecode_opcode {
+#define BITSTREAMOP_FUNCTION(name, effects, arglist, body) BCOP_BUILTIN_##name,
+#include "functions.cc"
+#undef BITSTREAMOP_FUNCTION
+	BCOP_LOADK,  // dst = constants[a]
+	BCOP_MOVE,  // dst = a
+	BCOP_TRUTH,  // dst = a as a 1 bit boolean
+	BCOP_LOADVAR,  // dst = variables[a]
+	BCOP_ASSIGN,  // Slot a of the current scope = dst
+	BCOP_REASSIGN,  // variables[a] = dst where it's bound, or slot b of the outermost scope
+	BCOP_SCOPE_PUSH,  // With layouts[a]
+	BCOP_SCOPE_POP,
+	BCOP_JUMP,  // Continue at a
+	BCOP_JUMP_ZERO,  // Continue at a if dst is zero
+	BCOP_JUMP_NONZERO,  // Continue at a if dst isn't zero
+	BCOP_REPEAT,  // Continue at a once the index in dst + 1 reaches the count in dst, else put it in slot b - 1 (if b) and count it
+	BCOP_SWITCH,  // Continue at the target of switches[a] for the case that dst selects
+	BCOP_DEFUN,  // Define functions[a]
+	BCOP_FIND_FUNC,  // dst = the current definition of user function names[a], which has to take b arguments
+	BCOP_TAIL_CALL,  // Like CALL, but if it's the running function rebind its arguments and start it over
+	BCOP_CALL,  // dst = call the user function in a, arguments follow it
+	BCOP_RETURN,  // Return dst
+	BCOP_DIE,  // Stop with names[a] as error message
+	BCOP_COUNT,
+};
+
+typedef struct {
+	uint32_t op;
+	uint32_t dst, a, b;
+} BytecodeInsn;
+
+typedef struct bytecode_function {
+	BytecodeInsn *code;
+	size_t length;
+	uint32_t register_count;
+	const struct expression_node *def;  // The UserFunctionDef node, NULL for the main program
+	struct userfunc_definition definition;  // What BCOP_DEFUN registers
+} BytecodeFunction;
+
+typedef struct {
+	const SwitchExprNode *node;
+	uint32_t *targets;  // One per case, then the default body or the end of the switch
+} BytecodeSwitch;
+
+typedef struct {
+	BytecodeFunction *functions;  // functions[0] is the main program
+	size_t function_count;
+	WidthInteger *constants;
+	size_t constant_count;
+	const char **names;  // Function names and error messages
+	size_t name_count;
+	// These point into the AST, so it has to outlive the program
+	const VariableResolution **variables;
+	size_t variable_count;
+	const ScopeLayout **layouts;
+	size_t layout_count;
+	BytecodeSwitch *switches;
+	size_t switch_count;
+} BytecodeProgram;
+
+BytecodeProgram *compile_bytecode(const ExprNode * program);
+void free_bytecode(BytecodeProgram * program);
+
+WidthInteger run_bytecode(InterpContext * context, const BytecodeProgram * program);
+
+void print_bytecode(FILE * file, const BytecodeProgram * program);
+
+#endif /* end of include guard: BYTECODE_H_ */
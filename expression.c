@@ -1,5 +1,8 @@
 #include "expression.h"
 #include "common.h"
+#include "functions.h"
+
+#include <stddef.h>
 
 #define UNPACK(...) __VA_ARGS__
 
@@ -30,20 +33,63 @@ typedef struct evaluate_expression_locals {
 	};
 } EvaluateExpressionLocals;
 
-static void
-push_evaluate_expression_locals(EvaluateExpressionLocals ** ptrptr, const ExprNode * expr)
+// Frames only take the locals of their own node type
+static const size_t evaluate_expression_locals_sizes[] = {
+#define BITSTREAMOP_EXPRNODE(name, elements, co_locals_def, self, co_locals_var, ctx, result, evalimpl, printer_var, printimpl) (offsetof(EvaluateExpressionLocals, as_##name) + sizeof(name##EvaluateExpressionLocals) + _Alignof(EvaluateExpressionLocals) - 1) & ~(_Alignof(EvaluateExpressionLocals) - 1),
+#include "expression.cc"
+#undef BITSTREAMOP_EXPRNODE
+};
+
+// Frames are bump-allocated from a list of chunks that never move, so pointers into caller frames stay valid.
+// Chunks are kept when emptied, a chunk only gets allocated when the stack grows deeper than ever before.
+typedef struct evaluate_frame_chunk {
+	struct evaluate_frame_chunk *prev, *next;
+	size_t size, used;
+	_Alignas(EvaluateExpressionLocals) uint8_t data[];
+} EvaluateFrameChunk;
+
+#define EVALUATE_FRAME_CHUNK_SIZE (64 << 10)
+
+static EvaluateFrameChunk *
+evaluate_frame_chunk_new(EvaluateFrameChunk * prev)
 {
-	EvaluateExpressionLocals * new_ptr = malloc(sizeof(EvaluateExpressionLocals));
-	EvaluateExpressionLocals * caller = *ptrptr;
-	*new_ptr = (EvaluateExpressionLocals) {
-		.caller = caller,
-		.context = caller ? caller->context : NULL,
-		.expression = expr,
-		.result = {0, 0},
-		.evaluated = false,
-		.entry = 0,
-		.finished = false,
+	size_t size = prev ? prev->size << 1 : EVALUATE_FRAME_CHUNK_SIZE;
+	EvaluateFrameChunk * chunk = malloc(sizeof(EvaluateFrameChunk) + size);
+	if (!chunk)
+		die("Failed to allocate evaluation frames");
+	*chunk = (EvaluateFrameChunk) {
+		.prev = prev,
+		.next = NULL,
+		.size = size,
+		.used = 0,
 	};
+	if (prev)
+		prev->next = chunk;
+	return chunk;
+}
+
+static void
+push_evaluate_expression_locals(InterpContext * context, EvaluateExpressionLocals ** ptrptr, const ExprNode * expr)
+{
+	size_t size = evaluate_expression_locals_sizes[expr->node_type];
+	EvaluateFrameChunk * chunk = context->frames;
+	if (!chunk)
+		chunk = context->frames = evaluate_frame_chunk_new(NULL);
+	if (chunk->size - chunk->used < size) {
+		chunk = context->frames = chunk->next ? chunk->next : evaluate_frame_chunk_new(chunk);
+		chunk->used = 0;
+	}
+	EvaluateExpressionLocals * new_ptr = (EvaluateExpressionLocals *) (chunk->data + chunk->used);
+	chunk->used += size;
+	// Only the header, the locals past this frame's size belong to the next one
+	new_ptr->caller = *ptrptr;
+	new_ptr->context = context;
+	new_ptr->expression = expr;
+	new_ptr->result = (WidthInteger) {0, 0};
+	new_ptr->evaluated = false;
+	new_ptr->entry = 0;
+	new_ptr->finished = false;
+	new_ptr->parent_result_address = NULL;
 	*ptrptr = new_ptr;
 }
 
@@ -51,17 +97,114 @@ static void
 pop_evaluate_expression_locals(EvaluateExpressionLocals ** ptrptr)
 {
 	EvaluateExpressionLocals * child = *ptrptr;
-	EvaluateExpressionLocals * caller = child->caller;
-	free(child);
-	*ptrptr = caller;
+	InterpContext * context = child->context;
+	EvaluateFrameChunk * chunk = context->frames;
+	chunk->used -= evaluate_expression_locals_sizes[child->expression->node_type];
+	if (!chunk->used && chunk->prev)
+		context->frames = chunk->prev;
+	*ptrptr = child->caller;
+}
+
+void
+free_evaluate_frames(InterpContext * context)
+{
+	EvaluateFrameChunk * chunk = context->frames;
+	while (chunk && chunk->prev)
+		chunk = chunk->prev;
+	while (chunk) {
+		EvaluateFrameChunk * next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	context->frames = NULL;
+}
+
+typedef struct {
+	uint64_t label;
+	uint32_t index;
+} SwitchCase;
+
+static int
+compare_switch_cases(const void * a, const void * b)
+{
+	const SwitchCase * lhs = a, * rhs = b;
+	if (lhs->label != rhs->label)
+		return lhs->label < rhs->label ? -1 : 1;
+	return lhs->index < rhs->index ? -1 : lhs->index > rhs->index;
+}
+
+void
+build_switch_dispatch(SwitchExprNode * self)
+{
+	SwitchDispatch * dispatch = &self->dispatch;
+	*dispatch = (SwitchDispatch) {0, 0, NULL, NULL};
+	if (!self->case_count)
+		return;
+	SwitchCase * cases = malloc(self->case_count * sizeof(SwitchCase));
+	if (!cases)
+		die("Failed to allocate switch cases");
+	for (uint64_t i = 0; i < self->case_count; ++i)
+		cases[i] = (SwitchCase) {self->labels[i], i};
+	qsort(cases, self->case_count, sizeof(SwitchCase), compare_switch_cases);
+	dispatch->min = cases[0].label;
+	uint64_t span = cases[self->case_count - 1].label - dispatch->min;
+	// A table is worth it while at least about half of it is used
+	if (span < 2 * self->case_count + 16) {
+		dispatch->dense_length = span + 1;
+		if (!(dispatch->dense = malloc(dispatch->dense_length * sizeof(uint32_t))))
+			die("Failed to allocate switch table");
+		for (uint64_t i = 0; i < dispatch->dense_length; ++i)
+			dispatch->dense[i] = self->case_count;
+		// Backwards, so that the first of repeated labels wins
+		for (uint64_t i = self->case_count; i-- > 0;)
+			dispatch->dense[cases[i].label - dispatch->min] = cases[i].index;
+	} else {
+		if (!(dispatch->sorted = malloc(self->case_count * sizeof(uint32_t))))
+			die("Failed to allocate switch table");
+		for (uint64_t i = 0; i < self->case_count; ++i)
+			dispatch->sorted[i] = cases[i].index;
+	}
+	free(cases);
+}
+
+void
+free_switch_dispatch(SwitchDispatch * dispatch)
+{
+	free(dispatch->dense);
+	free(dispatch->sorted);
+	*dispatch = (SwitchDispatch) {0, 0, NULL, NULL};
+}
+
+uint64_t
+switch_find_case(const SwitchExprNode * self, uint64_t value)
+{
+	const SwitchDispatch * dispatch = &self->dispatch;
+	if (dispatch->dense) {
+		if (value - dispatch->min >= dispatch->dense_length)
+			return self->case_count;
+		return dispatch->dense[value - dispatch->min];
+	}
+	if (!dispatch->sorted)
+		return self->case_count;
+	// The first of the cases with the label, they are sorted by index among themselves
+	uint64_t low = 0, high = self->case_count;
+	while (low < high) {
+		uint64_t middle = low + (high - low) / 2;
+		if (self->labels[dispatch->sorted[middle]] < value)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	if (low < self->case_count && self->labels[dispatch->sorted[low]] == value)
+		return dispatch->sorted[low];
+	return self->case_count;
 }
 
 WidthInteger
 evaluate_expression(InterpContext * __context, const ExprNode * __expr)
 {
 	EvaluateExpressionLocals * evaluate_expression__locals = NULL;
-	push_evaluate_expression_locals(&evaluate_expression__locals, __expr);
-	evaluate_expression__locals->context = __context;
+	push_evaluate_expression_locals(__context, &evaluate_expression__locals, __expr);
 	while (true) {
 evaluate_expression__next_iter:
 		if (evaluate_expression__locals->finished) {
@@ -76,7 +219,7 @@ evaluate_expression__next_iter:
 			pop_evaluate_expression_locals(&evaluate_expression__locals);
 		}
 		switch (evaluate_expression__locals->expression->node_type) {
-#define EVALUATE(retvar, subexpr, reentry) if (!evaluate_expression__locals->evaluated) { WidthInteger * retvar_ptr = &(retvar); evaluate_expression__locals->entry = reentry; evaluate_expression__locals->evaluated = true; push_evaluate_expression_locals(&evaluate_expression__locals, &(subexpr)); evaluate_expression__locals->parent_result_address = retvar_ptr; goto evaluate_expression__next_iter; } else { evaluate_expression__locals->evaluated = false; }
+#define EVALUATE(retvar, subexpr, reentry) if (!evaluate_expression__locals->evaluated) { WidthInteger * retvar_ptr = &(retvar); evaluate_expression__locals->entry = reentry; evaluate_expression__locals->evaluated = true; push_evaluate_expression_locals(evaluate_expression__locals->context, &evaluate_expression__locals, &(subexpr)); evaluate_expression__locals->parent_result_address = retvar_ptr; goto evaluate_expression__next_iter; } else { evaluate_expression__locals->evaluated = false; }
 #define CONTINUATION(n) /* FALLTHROUGH */ case n:;
 #define BITSTREAMOP_EXPRNODE(name, elements, co_locals_def, self, co_locals_var, ctx, result, evalimpl, printer_var, printimpl) case EXPRNODE_##name: { \
 		InterpContext *const ctx = evaluate_expression__locals->context; \
@@ -100,6 +243,32 @@ evaluate_expression__next_iter:
 	}
 }
 
+static void
+print_scope_layout(TreePrinter * printer, const ScopeLayout * layout)
+{
+	printer->start_field(printer);
+	printer->printf(printer, "layout.slot_count = %u", layout->slot_count);
+	printer->end_field(printer);
+	for (uint32_t i = 0; i < layout->slot_count; ++i) {
+		printer->start_field(printer);
+		printer->printf(printer, "layout.names[%u] = %s", i, layout->names[i]);
+		printer->end_field(printer);
+	}
+}
+
+static void
+print_variable_resolution(TreePrinter * printer, const VariableResolution * resolution)
+{
+	printer->start_field(printer);
+	printer->printf(printer, "resolution.unit_depth = %u", resolution->unit_depth);
+	printer->end_field(printer);
+	for (uint32_t i = 0; i < resolution->candidate_count; ++i) {
+		printer->start_field(printer);
+		printer->printf(printer, "resolution.candidates[%u] = (depth = %u, slot = %u)", i, resolution->candidates[i].depth, resolution->candidates[i].slot);
+		printer->end_field(printer);
+	}
+}
+
 void
 print_expression(TreePrinter * __printer, const ExprNode * __expr)
 {
@@ -119,6 +288,8 @@ print_expression(TreePrinter * __printer, const ExprNode * __expr)
 	{
 		switch (print_expression__locals.expression->node_type) {
 #define PRINT_CHILD(subexpr) print_expression__locals.printer->start_child(print_expression__locals.printer); print_expression(print_expression__locals.printer, &(subexpr)); print_expression__locals.printer->end_child(print_expression__locals.printer)
+#define PRINT_LAYOUT(layout) print_scope_layout(print_expression__locals.printer, &(layout))
+#define PRINT_RESOLUTION(resolution) print_variable_resolution(print_expression__locals.printer, &(resolution))
 #define BITSTREAMOP_EXPRNODE(name, elements, co_locals_def, self, co_locals_var, ctx, result, evalimpl, printer_var, printimpl) case EXPRNODE_##name: { \
 		TreePrinter *const printer_var = print_expression__locals.printer; \
 		const name##ExprNode *const self = &print_expression__locals.expression->as_##name; \
@@ -130,6 +301,8 @@ print_expression(TreePrinter * __printer, const ExprNode * __expr)
 #include "expression.cc"
 #undef BITSTREAMOP_EXPRNODE
 #undef PRINT_CHILD
+#undef PRINT_LAYOUT
+#undef PRINT_RESOLUTION
 		}
 	}
 }
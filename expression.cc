@@ -6,25 +6,19 @@ BITSTREAMOP_EXPRNODE(FunctionApplication, (
 	struct expression_node *args;
 ), (
 	size_t n, i;
-	WidthInteger *arg_values;
+	WidthInteger arg_values[BUILTIN_MAX_ARG_COUNT];
 ), self, L, ctx, result, (
 	L->n = self->arg_count;
 	if (L->n != self->func->args_def.length) {
 		die("Wrong argument count");
 	}
-	L->arg_values = calloc(L->n, sizeof(WidthInteger));
-	if (!L->arg_values) {
-		die("Failed to allocate argument values");
-	}
 	L->i = 0;
 CONTINUATION(1)
 	for (; L->i < L->n; ++L->i) {
 		EVALUATE(L->arg_values[L->i], self->args[L->i], 1);
 	}
-	scope_push(&ctx->scope);
+	// Builtins don't touch variables, so they run in the caller's scope
 	*result = self->func->impl(ctx, L->arg_values);
-	scope_pop(&ctx->scope);
-	free(L->arg_values);
 ), printer, (
 	printer->start_field(printer);
 	printer->printf(printer, "arg_count = %llu", self->arg_count);
@@ -51,6 +45,35 @@ CONTINUATION(1)
 	}
 ))
 
+// and/or, which skip their second operand once the first one decides the result
+BITSTREAMOP_EXPRNODE(ShortCircuit, (
+	bool is_or;
+	struct expression_node *args;  // lhs and rhs
+), (
+	WidthInteger lhs, rhs;
+), self, L, ctx, result, (
+CONTINUATION(1)
+	EVALUATE(L->lhs, self->args[0], 1);
+CONTINUATION(2)
+	if ((bool) L->lhs.value == self->is_or) {
+		*result = (WidthInteger) {self->is_or, 1};
+	} else {
+		EVALUATE(L->rhs, self->args[1], 2);
+		*result = (WidthInteger) {(bool) L->rhs.value, 1};
+	}
+), printer, (
+	printer->start_field(printer);
+	printer->printf(printer, "operator = %s", self->is_or ? "or" : "and");
+	printer->end_field(printer);
+
+	for (int i = 0; i < 2; ++i) {
+		printer->start_field(printer);
+		printer->printf(printer, "args[%d] =", i);
+		printer->end_field(printer);
+		PRINT_CHILD(self->args[i]);
+	}
+))
+
 BITSTREAMOP_EXPRNODE(Literal, (
 	WidthInteger value;
 ), (), self, L, ctx, result, (
@@ -64,17 +87,22 @@ BITSTREAMOP_EXPRNODE(Literal, (
 BITSTREAMOP_EXPRNODE(Assign, (
 	char *name;
 	struct expression_node *rhs;
+	uint32_t slot;  // In the current scope
 ), (
 	WidthInteger value;
 ), self, L, ctx, result, (
 	EVALUATE(L->value, *self->rhs, 0);
-	scope_assign_variable(&ctx->scope, self->name, L->value);
+	scope_assign_slot(ctx->scope, self->slot, L->value);
 	*result = L->value;
 ), printer, (
 	printer->start_field(printer);
 	printer->printf(printer, "name = %s", self->name);
 	printer->end_field(printer);
 
+	printer->start_field(printer);
+	printer->printf(printer, "slot = %u", self->slot);
+	printer->end_field(printer);
+
 	printer->start_field(printer);
 	printer->printf(printer, "rhs = %p", self->rhs);
 	printer->end_field(printer);
@@ -87,19 +115,17 @@ BITSTREAMOP_EXPRNODE(Assign, (
 BITSTREAMOP_EXPRNODE(Reassign, (
 	char *name;
 	struct expression_node *rhs;
+	VariableResolution resolution;
+	uint32_t root_slot;  // Where it goes if it's not bound anywhere
 ), (
 	WidthInteger value;
 ), self, L, ctx, result, (
 	EVALUATE(L->value, *self->rhs, 0);
-	WidthInteger *ptr = scope_find_variable(&ctx->scope, self->name);
+	WidthInteger *ptr = scope_find_variable(ctx->scope, &self->resolution);
 	if (ptr) {
 		*ptr = L->value;
 	} else {
-		InterpScope * scope = &ctx->scope;
-		while (scope->call_parent) {
-			scope = scope->call_parent;
-		}
-		scope_assign_variable(scope, self->name, L->value);
+		scope_assign_slot(scope_find_root(ctx->scope), self->root_slot, L->value);
 	}
 	*result = L->value;
 ), printer, (
@@ -107,6 +133,12 @@ BITSTREAMOP_EXPRNODE(Reassign, (
 	printer->printf(printer, "name = %s", self->name);
 	printer->end_field(printer);
 
+	PRINT_RESOLUTION(self->resolution);
+
+	printer->start_field(printer);
+	printer->printf(printer, "root_slot = %u", self->root_slot);
+	printer->end_field(printer);
+
 	printer->start_field(printer);
 	printer->printf(printer, "rhs = %p", self->rhs);
 	printer->end_field(printer);
@@ -117,8 +149,9 @@ BITSTREAMOP_EXPRNODE(Reassign, (
 
 BITSTREAMOP_EXPRNODE(Variable, (
 	char *name;
+	VariableResolution resolution;
 ), (), self, L, ctx, result, (
-	WidthInteger *ptr = scope_find_variable(&ctx->scope, self->name);
+	WidthInteger *ptr = scope_find_variable(ctx->scope, &self->resolution);
 	if (!ptr) {
 		die("Variable not found");
 	}
@@ -127,6 +160,8 @@ BITSTREAMOP_EXPRNODE(Variable, (
 	printer->start_field(printer);
 	printer->printf(printer, "name = %s", self->name);
 	printer->end_field(printer);
+
+	PRINT_RESOLUTION(self->resolution);
 ))
 
 BITSTREAMOP_EXPRNODE(StatementList, (
@@ -165,10 +200,11 @@ CONTINUATION(1)
 
 BITSTREAMOP_EXPRNODE(LoopWhile, (
 	struct expression_node *condition, *body;
+	ScopeLayout layout;
 ), (
 	WidthInteger condition;
 ), self, L, ctx, result, (
-	scope_push(&ctx->scope);
+	scope_enter(ctx, &self->layout);
 CONTINUATION(1)
 	EVALUATE(L->condition, *self->condition, 1);
 CONTINUATION(2)
@@ -176,8 +212,10 @@ CONTINUATION(2)
 		EVALUATE(*result, *self->body, 2);
 		EVALUATE(L->condition, *self->condition, 1);
 	}
-	scope_pop(&ctx->scope);
+	scope_leave(ctx, &self->layout);
 ), printer, (
+	PRINT_LAYOUT(self->layout);
+
 	printer->start_field(printer);
 	printer->printf(printer, "condition = %p", self->condition);
 	printer->end_field(printer);
@@ -193,20 +231,68 @@ CONTINUATION(2)
 	}
 ))
 
+// repeat(count, body) or repeat(count, index, body), count is evaluated once
+BITSTREAMOP_EXPRNODE(LoopRepeat, (
+	struct expression_node *count, *body;
+	char *index_name;  // NULL without an index variable
+	uint32_t index_slot;
+	ScopeLayout layout;
+), (
+	WidthInteger count;
+	uint64_t i;
+), self, L, ctx, result, (
+	scope_enter(ctx, &self->layout);
+CONTINUATION(1)
+	EVALUATE(L->count, *self->count, 1);
+	L->i = 0;
+CONTINUATION(2)
+	for (; L->i < L->count.value; ++L->i) {
+		if (self->index_name)
+			scope_assign_slot(ctx->scope, self->index_slot, (WidthInteger) {L->i, 64});
+		EVALUATE(*result, *self->body, 2);
+	}
+	scope_leave(ctx, &self->layout);
+), printer, (
+	PRINT_LAYOUT(self->layout);
+
+	printer->start_field(printer);
+	printer->printf(printer, "count = %p", self->count);
+	printer->end_field(printer);
+	if (self->count) {
+		PRINT_CHILD(*self->count);
+	}
+
+	if (self->index_name) {
+		printer->start_field(printer);
+		printer->printf(printer, "index = %s (slot = %u)", self->index_name, self->index_slot);
+		printer->end_field(printer);
+	}
+
+	printer->start_field(printer);
+	printer->printf(printer, "body = %p", self->body);
+	printer->end_field(printer);
+	if (self->body) {
+		PRINT_CHILD(*self->body);
+	}
+))
+
 BITSTREAMOP_EXPRNODE(CondIf, (
 	struct expression_node *condition, *body;
+	ScopeLayout layout;
 ), (
 	WidthInteger condition;
 ), self, L, ctx, result, (
-	scope_push(&ctx->scope);
+	scope_enter(ctx, &self->layout);
 CONTINUATION(1)
 	EVALUATE(L->condition, *self->condition, 1);
 CONTINUATION(2)
 	if (L->condition.value) {
 		EVALUATE(*result, *self->body, 2);
 	}
-	scope_pop(&ctx->scope);
+	scope_leave(ctx, &self->layout);
 ), printer, (
+	PRINT_LAYOUT(self->layout);
+
 	printer->start_field(printer);
 	printer->printf(printer, "condition = %p", self->condition);
 	printer->end_field(printer);
@@ -222,38 +308,108 @@ CONTINUATION(2)
 	}
 ))
 
+// switch(value, label, body, label, body, ..., default body), labels are numbers
+BITSTREAMOP_EXPRNODE(Switch, (
+	struct expression_node *value;
+	uint64_t case_count;
+	uint64_t *labels;
+	struct expression_node *bodies;  // One per case, then the default one if there's one
+	bool has_default;
+	SwitchDispatch dispatch;
+	ScopeLayout layout;
+), (
+	WidthInteger value;
+	uint64_t selected;
+), self, L, ctx, result, (
+	scope_enter(ctx, &self->layout);
+CONTINUATION(1)
+	EVALUATE(L->value, *self->value, 1);
+	L->selected = switch_find_case(self, L->value.value);
+CONTINUATION(2)
+	if (L->selected < self->case_count + self->has_default) {
+		EVALUATE(*result, self->bodies[L->selected], 2);
+	}
+	scope_leave(ctx, &self->layout);
+), printer, (
+	PRINT_LAYOUT(self->layout);
+
+	printer->start_field(printer);
+	printer->printf(printer, "value = %p", self->value);
+	printer->end_field(printer);
+	if (self->value) {
+		PRINT_CHILD(*self->value);
+	}
+
+	printer->start_field(printer);
+	printer->printf(printer, "dispatch = %s", self->dispatch.dense ? "dense" : "sorted");
+	printer->end_field(printer);
+
+	for (uint64_t i = 0; i < self->case_count + self->has_default; ++i) {
+		printer->start_field(printer);
+		if (i < self->case_count)
+			printer->printf(printer, "case %llu =", (unsigned long long) self->labels[i]);
+		else
+			printer->printf(printer, "default =");
+		printer->end_field(printer);
+		PRINT_CHILD(self->bodies[i]);
+	}
+))
+
 BITSTREAMOP_EXPRNODE(UserFunctionCall, (
 	uint64_t arg_count;
 	char *name;
 	struct expression_node *args;
+	struct userfunclist_node *cached_func;  // Inline cache, valid for the one context that runs the program
+	const ScopeLayout *tail_layout;  // The enclosing function's, if the call is in its tail position
 ), (
-	struct userfunclist_node *func;
+	const struct userfunc_definition *func;  // The arguments or the function itself may redefine it meanwhile
 	size_t n, i;
-	InterpScope caller_scope, function_scope;
+	InterpScope *caller_scope, *function_scope;
 	WidthInteger arg_value;
 ), self, L, ctx, result, (
-	L->func = userfunclist_find_function(ctx->user_functions, self->name);
-	if (!L->func) {
-		die("User function is not defined");
+	{
+		// Redefinitions repoint the node, so a cached one never goes stale
+		struct userfunclist_node *node = self->cached_func;
+		if (!node) {
+			node = userfunclist_find_function(&ctx->user_functions, self->name);
+			if (!node) {
+				die("User function is not defined");
+			}
+			((UserFunctionCallExprNode *) self)->cached_func = node;
+		}
+		L->func = node->definition;
 	}
 	L->n = self->arg_count;
 	if (L->n != L->func->args_def.length) {
 		die("Wrong argument count");
 	}
 	L->caller_scope = ctx->scope;
-	scope_push(&ctx->scope);
+	scope_enter(ctx, L->func->layout);
 	L->function_scope = ctx->scope;
 	ctx->scope = L->caller_scope;
 	L->i = 0;
 CONTINUATION(1)
 	for (; L->i < L->n; ++L->i) {
 		EVALUATE(L->arg_value, self->args[L->i], 1);
-		scope_assign_variable(&L->function_scope, L->func->args_def.entries[L->i].name, L->arg_value);
+		scope_assign_slot(L->function_scope, L->i, L->arg_value);
 	}
 	ctx->scope = L->function_scope;
+	if (L->func->layout == self->tail_layout) {
+		// The function calls itself as its last step, rebind the arguments and have its running call go again
+		for (L->i = 0; L->i < L->n; ++L->i)
+			scope_assign_slot(L->caller_scope, L->i, L->function_scope->slots[L->i].value);
+		scope_leave(ctx, L->func->layout);
+		ctx->tail_call = true;
+	} else {
 CONTINUATION(2)
-	EVALUATE(*result, *L->func->body, 2);
-	scope_pop(&ctx->scope);
+		while (true) {
+			EVALUATE(*result, *L->func->body, 2);
+			if (!ctx->tail_call)
+				break;
+			ctx->tail_call = false;
+		}
+		scope_leave(ctx, L->func->layout);
+	}
 ), printer, (
 	printer->start_field(printer);
 	printer->printf(printer, "name = %s", self->name);
@@ -263,6 +419,12 @@ CONTINUATION(2)
 	printer->printf(printer, "arg_count = %llu", self->arg_count);
 	printer->end_field(printer);
 
+	if (self->tail_layout) {
+		printer->start_field(printer);
+		printer->printf(printer, "tail call");
+		printer->end_field(printer);
+	}
+
 	if (!self->args) {
 		printer->start_field(printer);
 		printer->printf(printer, "args = %p", self->args);
@@ -277,13 +439,70 @@ CONTINUATION(2)
 	}
 ))
 
+// A call of a small function with its body copied in, see inline_user_functions
+BITSTREAMOP_EXPRNODE(InlinedCall, (
+	char *name;  // Of the function, for dumps
+	ArgumentsDef params;  // The function's, bound like a call binds them
+	struct expression_node *args;  // params.length of them
+	struct expression_node *body;
+	ScopeLayout layout;
+), (
+	size_t i;
+	InterpScope *caller_scope, *function_scope;
+	WidthInteger arg_value;
+), self, L, ctx, result, (
+	L->caller_scope = ctx->scope;
+	scope_enter(ctx, &self->layout);
+	L->function_scope = ctx->scope;
+	ctx->scope = L->caller_scope;
+	L->i = 0;
+CONTINUATION(1)
+	for (; L->i < self->params.length; ++L->i) {
+		EVALUATE(L->arg_value, self->args[L->i], 1);
+		scope_assign_slot(L->function_scope, L->i, L->arg_value);
+	}
+	ctx->scope = L->function_scope;
+CONTINUATION(2)
+	EVALUATE(*result, *self->body, 2);
+	scope_leave(ctx, &self->layout);
+), printer, (
+	printer->start_field(printer);
+	printer->printf(printer, "name = %s", self->name);
+	printer->end_field(printer);
+
+	for (uint64_t i = 0; i < self->params.length; ++i) {
+		printer->start_field(printer);
+		printer->printf(printer, "args[%llu] (%s) =", i, self->params.entries[i].name);
+		printer->end_field(printer);
+		PRINT_CHILD(self->args[i]);
+	}
+
+	PRINT_LAYOUT(self->layout);
+
+	printer->start_field(printer);
+	printer->printf(printer, "body = %p", self->body);
+	printer->end_field(printer);
+	if (self->body) {
+		PRINT_CHILD(*self->body);
+	}
+))
+
 BITSTREAMOP_EXPRNODE(UserFunctionDef, (
 	char *name;
 	struct expression_node *body;
 	ArgumentsDef args;
+	ScopeLayout layout;
+	struct userfunc_definition definition;  // Made on the first run, the node may be moved until then
 ), (), self, L, ctx, result, (
 	// TODO consider using reassign-like logic
-	userfunclist_add_function(&ctx->user_functions, self->name, self->args, self->body);
+	if (!self->definition.layout) {
+		((UserFunctionDefExprNode *) self)->definition = (struct userfunc_definition) {
+			.body = self->body,
+			.args_def = self->args,
+			.layout = &self->layout,
+		};
+	}
+	userfunclist_add_function(&ctx->user_functions, self->name, &self->definition);
 ), printer, (
 	printer->start_field(printer);
 	printer->printf(printer, "name = %s", self->name);
@@ -305,6 +524,8 @@ BITSTREAMOP_EXPRNODE(UserFunctionDef, (
 		}
 	}
 
+	PRINT_LAYOUT(self->layout);
+
 	printer->start_field(printer);
 	printer->printf(printer, "body = %p", self->body);
 	printer->end_field(printer);
@@ -8,6 +8,14 @@
 
 struct expression_node;
 
+// Case lookup of a switch, built by build_switch_dispatch once the labels are known
+typedef struct {
+	uint64_t min;
+	uint64_t dense_length;
+	uint32_t *dense;  // Case index for each value from min when the labels are close together, NULL otherwise
+	uint32_t *sorted;  // Case indices sorted by label otherwise
+} SwitchDispatch;
+
 #define BITSTREAMOP_EXPRNODE(name, elements, co_locals_def, self, co_locals_var, ctx, result, evalimpl, printer, printimpl) typedef struct { EXPRESSION_H__UNPACK elements } name##ExprNode;
 #include "expression.cc"
 #undef BITSTREAMOP_EXPRNODE
@@ -27,9 +35,15 @@ typedef struct expression_node {
 } ExprNode;
 
 WidthInteger evaluate_expression(InterpContext * context, const ExprNode * expr);
+void free_evaluate_frames(InterpContext * context);
 
 void print_expression(TreePrinter * printer, const ExprNode * expr);
 
+void build_switch_dispatch(SwitchExprNode * self);
+void free_switch_dispatch(SwitchDispatch * dispatch);
+// The index of the first case with the label, or case_count when there's none
+uint64_t switch_find_case(const SwitchExprNode * self, uint64_t value);
+
 __attribute__((unused)) inline static void
 destruct_expression(struct expression_node * self)
 {
@@ -0,0 +1,50 @@
+#ifndef FUNCTION_SUPPORT_H_
+#define FUNCTION_SUPPORT_H_
+
+#include "interp_types.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// What the builtin bodies in functions.cc use, shared by functions.c and the C that native.c emits
+
+__attribute__((unused, noreturn)) static void
+die(char * msg)
+{
+	fprintf(stderr, "Error: %s\n", msg);
+	exit(1);
+}
+
+__attribute__((unused)) inline static int64_t
+sigextend_value(WidthInteger width_int)
+{
+	uint64_t value = width_int.value;
+	if (width_int.width > 63) {
+		return value;
+	}
+	uint64_t mask = (1 << width_int.width) - 1;
+	uint64_t sign_bit_mask = width_int.width ? 0 : 1 << (width_int.width - 1);
+	if (value & sign_bit_mask) {
+		return value | ~mask;
+	} else {
+		return value;
+	}
+}
+
+__attribute__((unused)) static WidthInteger
+fix_width(WidthInteger value)
+{
+	if (!value.width) {
+		value.value = 0;
+	}
+	if (value.width < 64) {
+		value.value &= (1ULL << value.width) - 1;
+	}
+	return value;
+}
+
+#define UNPACK(...) __VA_ARGS__
+#define MAX(a, b) ((a) < (b) ? (b) : (a))
+#define MIN(a, b) ((a) > (b) ? (b) : (a))
+
+#endif /* end of include guard: FUNCTION_SUPPORT_H_ */
@@ -1,51 +1,14 @@
 #include "functions.h"
+#include "function_support.h"
 #include "interp_types.h"
 #include "common.h"
+#include "name_table.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 
-__attribute__((noreturn)) static void
-die(char * msg)
-{
-	fprintf(stderr, "Error: %s\n", msg);
-	exit(1);
-}
-
-inline static int64_t
-sigextend_value(WidthInteger width_int)
-{
-	uint64_t value = width_int.value;
-	if (width_int.width > 63) {
-		return value;
-	}
-	uint64_t mask = (1 << width_int.width) - 1;
-	uint64_t sign_bit_mask = width_int.width ? 0 : 1 << (width_int.width - 1);
-	if (value & sign_bit_mask) {
-		return value | ~mask;
-	} else {
-		return value;
-	}
-}
-
-static WidthInteger
-fix_width(WidthInteger value)
-{
-	if (!value.width) {
-		value.value = 0;
-	}
-	if (value.width < 64) {
-		value.value &= (1ULL << value.width) - 1;
-	}
-	return value;
-}
-
-#define UNPACK(...) __VA_ARGS__
-#define MAX(a, b) ((a) < (b) ? (b) : (a))
-#define MIN(a, b) ((a) > (b) ? (b) : (a))
-
 // Implementations:
-#define BITSTREAMOP_FUNCTION(name, arglist, body) WidthInteger funcimpl_##name(InterpContext * context, Argtype_##name * args) { (void) context; (void) args; UNPACK body }
+#define BITSTREAMOP_FUNCTION(name, effects, arglist, body) WidthInteger funcimpl_##name(InterpContext * context, Argtype_##name * args) { (void) context; (void) args; UNPACK body }
 
 #include "functions.cc"
 
@@ -54,7 +17,7 @@ fix_width(WidthInteger value)
 // Table:
 #define BITSTREAMOP_ARG(aname) {.name = #aname},
 #define BITSTREAMOP_ARGLIST(...) {.length = sizeof((ArgumentsDefEntry[]) {__VA_ARGS__}) / sizeof(ArgumentsDefEntry), .entries = (ArgumentsDefEntry[]) {__VA_ARGS__}}
-#define BITSTREAMOP_FUNCTION(fname, arglist, body) {.name = #fname, .impl = (WidthInteger (*)(InterpContext *, void *)) &funcimpl_##fname, .args_def = arglist},
+#define BITSTREAMOP_FUNCTION(fname, feffects, arglist, body) {.name = #fname, .impl = (WidthInteger (*)(InterpContext *, void *)) &funcimpl_##fname, .args_def = arglist, .effects = FUNCTION_##feffects},
 static FunctionTableEntry function_table_values[] = {
 #include "functions.cc"
 };
@@ -64,13 +27,27 @@ FunctionTable function_table = {
 	.entries = function_table_values,
 };
 
+// Kept at most half full, so most lookups hit the first slot
+#define FUNCTION_INDEX_CAPACITY 128
+_Static_assert(FUNCTION_INDEX_CAPACITY >= 2 * sizeof(function_table_values) / sizeof(FunctionTableEntry), "Function index too small");
+static NameTableSlot function_index_slots[FUNCTION_INDEX_CAPACITY];
+static NameTable function_index = {
+	.mask = FUNCTION_INDEX_CAPACITY - 1,
+	.slots = function_index_slots,
+};
+
+__attribute__((constructor)) static void
+build_function_index(void)
+{
+	for (size_t i = 0; i < function_table.length; ++i)
+		name_table_insert(&function_index, function_table.entries[i].name, i);
+}
+
 FunctionTableEntry *
 find_function(char * name)
 {
-	for (size_t i = 0; i < function_table.length; ++i) {
-		if (!strcmp(function_table.entries[i].name, name)) {
-			return &function_table.entries[i];
-		}
-	}
-	return NULL;
+	size_t index;
+	if (!name_table_find(&function_index, name, strlen(name), &index))
+		return NULL;
+	return &function_table.entries[index];
 }
@@ -5,11 +5,21 @@
 
 #define BITSTREAMOP_ARG(name) WidthInteger name;
 #define BITSTREAMOP_ARGLIST(args) args
-#define BITSTREAMOP_FUNCTION(name, arglist, body) typedef struct { arglist } Argtype_##name; WidthInteger funcimpl_##name(InterpContext * context, Argtype_##name * args);
+#define BITSTREAMOP_FUNCTION(name, effects, arglist, body) typedef struct { arglist } Argtype_##name; WidthInteger funcimpl_##name(InterpContext * context, Argtype_##name * args);
 
 #include "functions.cc"
 
 #undef BITSTREAMOP_FUNCTION
+
+// Large enough for the arguments of any builtin, so calls can keep them inline
+typedef union {
+#define BITSTREAMOP_FUNCTION(name, effects, arglist, body) Argtype_##name as_##name;
+#include "functions.cc"
+#undef BITSTREAMOP_FUNCTION
+} BuiltinArguments;
+
+#define BUILTIN_MAX_ARG_COUNT (sizeof(BuiltinArguments) / sizeof(WidthInteger))
+
 #undef BITSTREAMOP_ARGLIST
 #undef BITSTREAMOP_ARG
 
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <string.h>
 #include "bitio.h"
+#include "name_table.h"
 
 typedef struct {
 	uint64_t value;
@@ -19,34 +20,84 @@ typedef struct {
 	ArgumentsDefEntry *entries;
 } ArgumentsDef;
 
-struct varlist_node {
-	struct varlist_node *next;
-	char *name;
+// Slots of a scope, the names are canonical pointers shared with the AST
+typedef struct {
+	uint32_t slot_count;
+	char **names;
+} ScopeLayout;
+
+typedef struct {
+	uint32_t depth;  // Scopes to go up from the current one
+	uint32_t slot;
+} ScopeSlotRef;
+
+// Where a name may be bound, filled in by resolve_variables
+typedef struct {
+	char *name;  // Canonical, compared by pointer
+	uint32_t candidate_count;
+	ScopeSlotRef *candidates;  // Innermost first, the first bound one wins
+	uint32_t unit_depth;  // Scopes up to the caller's innermost one, which is searched by name with the ones above it
+} VariableResolution;
+
+typedef struct {
 	WidthInteger value;
+	bool bound;
+} InterpSlot;
+
+struct interp_context;
+
+// One definition of a user function, owned by what defines it and never changed, so a call takes it once when it
+// looks the function up and keeps to it even if its arguments redefine the function
+struct userfunc_definition {
+	struct expression_node *body;
+	ArgumentsDef args_def;
+	const ScopeLayout *layout;  // Arguments take the first slots
+	const struct bytecode_function *code;  // Compiled body, when running bytecode
+	WidthInteger (*native)(struct interp_context * ctx);  // Compiled body, when running native code
 };
 
 struct userfunclist_node {
-	struct userfunclist_node *next;
+	struct userfunclist_node *next;  // In the same bucket
 	char *name;
-	struct expression_node *body;
-	ArgumentsDef args_def;
+	uint64_t hash;
+	const struct userfunc_definition *definition;  // The latest one
 };
 
+// Nodes are never removed, redefinitions repoint them, so call sites can keep pointers to them
+typedef struct {
+	struct userfunclist_node **buckets;
+	size_t bucket_count, count;
+} UserFunctionRegistry;
+
 typedef struct interp_scope {
-	struct interp_scope *call_parent;
-	struct varlist_node *variables;
+	struct interp_scope *call_parent;  // Next free one of the size class while pooled
+	const ScopeLayout *layout;
+	uint32_t size_class;  // Room for 1 << size_class slots
+	InterpSlot slots[];
 } InterpScope;
 
-typedef struct {
+#define SCOPE_SIZE_CLASS_COUNT 33
+
+typedef struct interp_context {
 	BitIO *io_in, *io_out;
-	InterpScope scope;
-	struct userfunclist_node *user_functions;
+	InterpScope *scope;
+	InterpScope *scope_pool[SCOPE_SIZE_CLASS_COUNT];  // Popped scopes, reused by the next push of the size class
+	UserFunctionRegistry user_functions;
+	struct evaluate_frame_chunk *frames;  // Frame stack of evaluate_expression, kept between calls
+	bool tail_call;  // A tail call rebound the arguments of the running user function, which has to go again
 } InterpContext;
 
+enum function_effects {
+	FUNCTION_PURE,  // Depends on the arguments only, so it can be evaluated ahead of time
+	FUNCTION_TRAPS,  // Like pure, but it may trap for some arguments, so it has to run where it's reached
+	FUNCTION_IO,  // Uses the streams
+};
+
 typedef struct {
 	char *name;
 	WidthInteger (*impl)(InterpContext * context, void * args);
 	ArgumentsDef args_def;
+	enum function_effects effects;
 } FunctionTableEntry;
 
 typedef struct {
@@ -55,10 +106,13 @@ typedef struct {
 } FunctionTable;
 
 __attribute__((unused)) inline static struct userfunclist_node*
-userfunclist_find_function(struct userfunclist_node * funcnode, char * name)
+userfunclist_find_hashed(const UserFunctionRegistry * registry, const char * name, uint64_t hash)
 {
+	if (!registry->bucket_count)
+		return NULL;
+	struct userfunclist_node *funcnode = registry->buckets[hash & (registry->bucket_count - 1)];
 	while (funcnode) {
-		if (!strcmp(name, funcnode->name)) {
+		if (funcnode->hash == hash && !strcmp(name, funcnode->name)) {
 			return funcnode;
 		}
 		funcnode = funcnode->next;
@@ -66,112 +120,177 @@ userfunclist_find_function(struct userfunclist_node * funcnode, char * name)
 	return NULL;
 }
 
-__attribute__((unused)) inline static void
-userfunclist_add_function(struct userfunclist_node ** funcnodeptr, char * name, ArgumentsDef args_def, struct expression_node *body)
+__attribute__((unused)) inline static struct userfunclist_node*
+userfunclist_find_function(const UserFunctionRegistry * registry, const char * name)
 {
-	if (!funcnodeptr)
-		return;
+	return userfunclist_find_hashed(registry, name, name_hash(name, strlen(name)));
+}
+
+// Redefining a function repoints its node, so definitions inside loops don't pile up
+__attribute__((unused)) inline static struct userfunclist_node*
+userfunclist_add_function(UserFunctionRegistry * registry, char * name, const struct userfunc_definition * definition)
+{
+	uint64_t hash = name_hash(name, strlen(name));
+	struct userfunclist_node *node = userfunclist_find_hashed(registry, name, hash);
+	if (node) {
+		node->definition = definition;
+		return node;
+	}
+	if (registry->count >= registry->bucket_count) {
+		size_t bucket_count = registry->bucket_count ? registry->bucket_count << 1 : 16;
+		struct userfunclist_node **buckets = calloc(bucket_count, sizeof(struct userfunclist_node *));
+		if (!buckets) {
+			fprintf(stderr, "Failed to allocate user function table\n");
+			exit(1);
+		}
+		for (size_t i = 0; i < registry->bucket_count; ++i) {
+			struct userfunclist_node *funcnode = registry->buckets[i];
+			while (funcnode) {
+				struct userfunclist_node *next = funcnode->next;
+				funcnode->next = buckets[funcnode->hash & (bucket_count - 1)];
+				buckets[funcnode->hash & (bucket_count - 1)] = funcnode;
+				funcnode = next;
+			}
+		}
+		free(registry->buckets);
+		registry->buckets = buckets;
+		registry->bucket_count = bucket_count;
+	}
+	struct userfunclist_node **bucket = &registry->buckets[hash & (registry->bucket_count - 1)];
 	struct userfunclist_node *new_node = malloc(sizeof(struct userfunclist_node));
 	if (!new_node) {
 		fprintf(stderr, "Failed to allocate user function node\n");
 		exit(1);
 	}
 	*new_node = (struct userfunclist_node) {
-		.next = *funcnodeptr,
+		.next = *bucket,
 		.name = strdup(name),
-		.body = body,
-		.args_def = args_def,
+		.hash = hash,
+		.definition = definition,
 	};
-	*funcnodeptr = new_node;
+	*bucket = new_node;
+	++registry->count;
+	return new_node;
 }
 
 __attribute__((unused)) inline static void
-userfunclist_clear(struct userfunclist_node * funcnode)
+userfunclist_clear(UserFunctionRegistry * registry)
 {
-	while (funcnode) {
-		struct userfunclist_node *next = funcnode->next;
-		free(funcnode->name);
-		// funcnode->body and funcnode->args_def.entries are owned by the UserFunctionDef node
-		free(funcnode);
-		funcnode = next;
+	for (size_t i = 0; i < registry->bucket_count; ++i) {
+		struct userfunclist_node *funcnode = registry->buckets[i];
+		while (funcnode) {
+			struct userfunclist_node *next = funcnode->next;
+			free(funcnode->name);
+			// funcnode->definition is owned by what defined it
+			free(funcnode);
+			funcnode = next;
+		}
 	}
+	free(registry->buckets);
+	*registry = (UserFunctionRegistry) {NULL, 0, 0};
 }
 
 __attribute__((unused)) inline static WidthInteger*
-scope_find_variable(InterpScope * scope, char * name)
+scope_find_variable(InterpScope * scope, const VariableResolution * var)
 {
-	while (scope) {
-		struct varlist_node *varnode = scope->variables;
-		while (varnode) {
-			if (!strcmp(name, varnode->name)) {
-				return &varnode->value;
-			}
-			varnode = varnode->next;
-		}
+	uint32_t depth = 0;
+	for (uint32_t i = 0; i < var->candidate_count; ++i) {
+		for (; depth < var->candidates[i].depth; ++depth)
+			scope = scope->call_parent;
+		InterpSlot *slot = &scope->slots[var->candidates[i].slot];
+		if (slot->bound)
+			return &slot->value;
+	}
+	for (; depth < var->unit_depth; ++depth)
 		scope = scope->call_parent;
+	// Functions see their callers' variables, which can't be resolved statically
+	for (; scope; scope = scope->call_parent) {
+		if (!scope->layout)
+			continue;
+		for (uint32_t i = scope->layout->slot_count; i-- > 0;) {
+			if (scope->layout->names[i] == var->name && scope->slots[i].bound)
+				return &scope->slots[i].value;
+		}
 	}
 	return NULL;
 }
 
+__attribute__((unused)) inline static InterpScope*
+scope_find_root(InterpScope * scope)
+{
+	while (scope->call_parent)
+		scope = scope->call_parent;
+	return scope;
+}
+
 __attribute__((unused)) inline static void
-scope_assign_variable(InterpScope * scope, char * name, WidthInteger value)
+scope_assign_slot(InterpScope * scope, uint32_t slot, WidthInteger value)
 {
-	if (!scope)
-		return;
-	struct varlist_node *new_node = malloc(sizeof(struct varlist_node));
-	if (!new_node) {
-		fprintf(stderr, "Failed to allocate variable node\n");
-		exit(1);
-	}
-	*new_node = (struct varlist_node) {
-		.next = scope->variables,
-		.name = strdup(name),
+	scope->slots[slot] = (InterpSlot) {
 		.value = value,
+		.bound = true,
 	};
-	scope->variables = new_node;
 }
 
+// layout may be NULL for a scope without variables
 __attribute__((unused)) inline static void
-scope_clear(InterpScope * scope)
+scope_push(InterpContext * ctx, const ScopeLayout * layout)
 {
-	if (!scope)
-		return;
-	struct varlist_node *varnode = scope->variables;
-	while (varnode) {
-		struct varlist_node *next = varnode->next;
-		free(varnode->name);
-		free(varnode);
-		varnode = next;
+	uint32_t slot_count = layout ? layout->slot_count : 0;
+	uint32_t size_class = slot_count > 1 ? 32 - __builtin_clz(slot_count - 1) : 0;
+	InterpScope *new_scope = ctx->scope_pool[size_class];
+	if (new_scope) {
+		ctx->scope_pool[size_class] = new_scope->call_parent;
+	} else {
+		new_scope = malloc(sizeof(InterpScope) + ((size_t) 1 << size_class) * sizeof(InterpSlot));
+		if (!new_scope) {
+			fprintf(stderr, "Failed to allocate scope\n");
+			exit(1);
+		}
+		new_scope->size_class = size_class;
 	}
-	scope->variables = NULL;
+	new_scope->call_parent = ctx->scope;
+	new_scope->layout = layout;
+	for (uint32_t i = 0; i < slot_count; ++i)
+		new_scope->slots[i].bound = false;
+	ctx->scope = new_scope;
 }
 
 __attribute__((unused)) inline static void
-scope_push(InterpScope * scope)
+scope_pop(InterpContext * ctx)
 {
-	InterpScope *parent = malloc(sizeof(InterpScope));
-	if (!parent) {
-		fprintf(stderr, "Failed to allocate scope\n");
-		exit(1);
-	}
-	*parent = *scope;
-	*scope = (InterpScope) {
-		.call_parent = parent,
-		.variables = NULL,
-	};
+	InterpScope *scope = ctx->scope;
+	ctx->scope = scope->call_parent;
+	scope->call_parent = ctx->scope_pool[scope->size_class];
+	ctx->scope_pool[scope->size_class] = scope;
+}
+
+// Nothing can be bound in a scope without slots, so the resolver leaves them out of the
+// depths and they're never created. The program's own scope is always pushed.
+__attribute__((unused)) inline static void
+scope_enter(InterpContext * ctx, const ScopeLayout * layout)
+{
+	if (layout->slot_count)
+		scope_push(ctx, layout);
 }
 
 __attribute__((unused)) inline static void
-scope_pop(InterpScope * scope)
+scope_leave(InterpContext * ctx, const ScopeLayout * layout)
 {
-	scope_clear(scope);
-	InterpScope parent = {NULL, NULL};
-	InterpScope *parent_ptr = scope->call_parent;
-	if (parent_ptr) {
-		parent = *parent_ptr;
-		free(parent_ptr);
+	if (layout->slot_count)
+		scope_pop(ctx);
+}
+
+__attribute__((unused)) inline static void
+scope_pool_clear(InterpContext * ctx)
+{
+	for (size_t i = 0; i < SCOPE_SIZE_CLASS_COUNT; ++i) {
+		while (ctx->scope_pool[i]) {
+			InterpScope *next = ctx->scope_pool[i]->call_parent;
+			free(ctx->scope_pool[i]);
+			ctx->scope_pool[i] = next;
+		}
 	}
-	*scope = parent;
 }
 
 #endif /* end of include guard: INTERP_TYPES_H_ */
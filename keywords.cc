@@ -0,0 +1,10 @@
+#ifdef BITSTREAMOP_KEYWORD
+
+BITSTREAMOP_KEYWORD(WHILE, while)
+BITSTREAMOP_KEYWORD(IF, if)
+BITSTREAMOP_KEYWORD(SWITCH, switch)
+BITSTREAMOP_KEYWORD(REPEAT, repeat)
+BITSTREAMOP_KEYWORD(FUNCTION, function)
+BITSTREAMOP_KEYWORD(CALL, call)
+
+#endif
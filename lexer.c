@@ -8,7 +8,9 @@ typedef enum {
 } LexerState;
 
 struct lexer {
-	CharSlice untokenized;
+	CharSlice untokenized;  // Points into buffer, tokens are consumed from the front without moving the rest
+	char *buffer;
+	size_t buffer_capacity;
 	CharacterClass next_char_class;
 	char next_char;
 	bool source_end;
@@ -122,6 +124,8 @@ lexer_new()
 			.ptr = buffer,
 			.length = 0,
 		},
+		.buffer = buffer,
+		.buffer_capacity = 16,
 		.next_char_class = CHCLS_UNKNOWN,
 		.next_char = 0,
 		.source_end = false,
@@ -133,8 +137,9 @@ lexer_new()
 void
 lexer_delete(Lexer * lexer)
 {
-	if (lexer->untokenized.ptr) {
-		free(lexer->untokenized.ptr);
+	if (lexer->buffer) {
+		free(lexer->buffer);
+		lexer->buffer = NULL;
 		lexer->untokenized.ptr = NULL;
 	}
 	if (lexer->token) {
@@ -171,34 +176,57 @@ lexer_end(Lexer * lexer)
 
 static void lexer_poll_iteration(Lexer * lexer, ConstCharSlice * slc, bool source_end);
 
+// Makes room for length more bytes after lexer->untokenized
+static void
+lexer_reserve(Lexer * lexer, size_t length)
+{
+	size_t offset = lexer->untokenized.ptr - lexer->buffer;
+	size_t needed = lexer->untokenized.length + length;
+	if (offset + needed <= lexer->buffer_capacity)
+		return;
+	if (needed > lexer->buffer_capacity) {
+		size_t new_capacity = lexer->buffer_capacity << 1;
+		while (new_capacity < needed)
+			new_capacity <<= 1;
+		char *new_buffer = malloc(new_capacity);
+		if (!new_buffer) {
+			fprintf(stderr, "Failed to resize internal lexer buffer\n");
+			exit(1);
+		}
+		memcpy(new_buffer, lexer->untokenized.ptr, lexer->untokenized.length);
+		free(lexer->buffer);
+		lexer->buffer = new_buffer;
+		lexer->buffer_capacity = new_capacity;
+	} else {
+		memmove(lexer->buffer, lexer->untokenized.ptr, lexer->untokenized.length);
+	}
+	lexer->untokenized.ptr = lexer->buffer;
+}
+
 static void
 lexer_stash(Lexer * lexer, const char * ptr, size_t length, ConstCharSlice slc, bool arguments_used)
 {
 	if (slc.ptr && slc.length) {
 		// Replace lexer->untokenized data with remaining slice
-		if (slc.ptr + slc.length != lexer->untokenized.ptr + lexer->untokenized.length) {
-			if (!(lexer->untokenized.ptr = realloc(lexer->untokenized.ptr, slc.length))) {
-				fprintf(stderr, "Failed to resize internal lexer buffer\n");
-				exit(1);
-			}
-		}
-		if (lexer->untokenized.ptr != slc.ptr) {
-			memmove(lexer->untokenized.ptr, slc.ptr, slc.length);
+		if (slc.ptr >= lexer->buffer && slc.ptr < lexer->buffer + lexer->buffer_capacity) {
+			lexer->untokenized.ptr = lexer->buffer + (slc.ptr - lexer->buffer);
+		} else {
+			lexer->untokenized.ptr = lexer->buffer;
+			lexer->untokenized.length = 0;
+			lexer_reserve(lexer, slc.length);
+			memcpy(lexer->untokenized.ptr, slc.ptr, slc.length);
 		}
 		lexer->untokenized.length = slc.length;
 	} else {
 		// Clear lexer->untokenized data
+		lexer->untokenized.ptr = lexer->buffer;
 		lexer->untokenized.length = 0;
 	}
 	if (!arguments_used && ptr && length) {
 		// Append
-		size_t total_length = lexer->untokenized.length + length;
-		if (!(lexer->untokenized.ptr = realloc(lexer->untokenized.ptr, total_length))) {
-			fprintf(stderr, "Failed to resize internal lexer buffer\n");
-			exit(1);
-		}
-		char *dest = lexer->untokenized.ptr + lexer->untokenized.length;
-		memcpy(dest, ptr, length);
+		lexer_reserve(lexer, length);
+		memcpy(lexer->untokenized.ptr + lexer->untokenized.length, ptr, length);
+		lexer->untokenized.length += length;
 	}
 }
 
@@ -357,25 +385,11 @@ lexer_poll_iteration(Lexer * lexer, ConstCharSlice * slc, bool source_end)
 			lexer->token->as_Number.value = literal_value;
 			free(full_token);  // FREE full_token
 		} else {
-			if (!strcmp(full_token, "while")) {
-				lexer->token = allocate_token_data();
-				lexer->token->token_type = TOKENTYPE_Keyword;
-				lexer->token->as_Keyword.keyword_type = KWTT_WHILE;
-				free(full_token);  // FREE full_token
-			} else if (!strcmp(full_token, "if")) {
-				lexer->token = allocate_token_data();
-				lexer->token->token_type = TOKENTYPE_Keyword;
-				lexer->token->as_Keyword.keyword_type = KWTT_IF;
-				free(full_token);  // FREE full_token
-			} else if (!strcmp(full_token, "function")) {
-				lexer->token = allocate_token_data();
-				lexer->token->token_type = TOKENTYPE_Keyword;
-				lexer->token->as_Keyword.keyword_type = KWTT_FUNCTION;
-				free(full_token);  // FREE full_token
-			} else if (!strcmp(full_token, "call")) {
+			enum keyword_token_type keyword_type;
+			if (find_keyword(full_token, 1 + token_end, &keyword_type)) {
 				lexer->token = allocate_token_data();
 				lexer->token->token_type = TOKENTYPE_Keyword;
-				lexer->token->as_Keyword.keyword_type = KWTT_CALL;
+				lexer->token->as_Keyword.keyword_type = keyword_type;
 				free(full_token);  // FREE full_token
 			} else {
 				lexer->token = allocate_token_data();
@@ -0,0 +1,62 @@
+#ifndef NAME_TABLE_H_
+#define NAME_TABLE_H_
+
+#include "common.h"
+
+#include <string.h>
+
+// Open addressing hash index over a fixed list of names, like the ones the X-macros generate.
+// The capacity has to be a power of two larger than the number of names.
+
+typedef struct {
+	const char *name;  // NULL for an empty slot
+	size_t length;
+	size_t index;
+} NameTableSlot;
+
+typedef struct {
+	size_t mask;
+	NameTableSlot *slots;
+} NameTable;
+
+// FNV-1a
+__attribute__((unused)) inline static uint64_t
+name_hash(const char * ptr, size_t length)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char) ptr[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+__attribute__((unused)) inline static void
+name_table_insert(NameTable * table, const char * name, size_t index)
+{
+	size_t length = strlen(name);
+	size_t i = name_hash(name, length) & table->mask;
+	while (table->slots[i].name)
+		i = (i + 1) & table->mask;
+	table->slots[i] = (NameTableSlot) {
+		.name = name,
+		.length = length,
+		.index = index,
+	};
+}
+
+// Returns false if the name isn't in the table
+__attribute__((unused)) inline static bool
+name_table_find(const NameTable * table, const char * ptr, size_t length, size_t * index)
+{
+	for (size_t i = name_hash(ptr, length) & table->mask; table->slots[i].name; i = (i + 1) & table->mask) {
+		const NameTableSlot * slot = &table->slots[i];
+		if (slot->length == length && !memcmp(slot->name, ptr, length)) {
+			*index = slot->index;
+			return true;
+		}
+	}
+	return false;
+}
+
+#endif /* end of include guard: NAME_TABLE_H_ */
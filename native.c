@@ -0,0 +1,870 @@
+#include "native.h"
+#include "functions.h"
+#include "common.h"
+#include "name_table.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The headers the emitted C includes, built into the executable so native programs build wherever it's installed.
+// The Makefile has native.o depend on the same list.
+#define NATIVE_HEADERS(X) \
+	X(header_bitio_h, "bitio.h") \
+	X(header_common_h, "common.h") \
+	X(header_function_support_h, "function_support.h") \
+	X(header_functions_cc, "functions.cc") \
+	X(header_functions_h, "functions.h") \
+	X(header_interp_types_h, "interp_types.h") \
+	X(header_name_table_h, "name_table.h")
+
+#define EMBED_HEADER(symbol, path) \
+	__asm__( \
+		".pushsection .rodata\n" \
+		".global " #symbol "\n.hidden " #symbol "\n" #symbol ":\n" \
+		".incbin \"" path "\"\n" \
+		".global " #symbol "_end\n.hidden " #symbol "_end\n" #symbol "_end:\n" \
+		".popsection\n"); \
+	extern const char symbol[], symbol##_end[];
+NATIVE_HEADERS(EMBED_HEADER)
+#undef EMBED_HEADER
+
+typedef struct {
+	const char *name;
+	const char *data, *end;
+} EmbeddedHeader;
+
+static const EmbeddedHeader native_headers[] = {
+#define HEADER_ENTRY(symbol, path) {path, symbol, symbol##_end},
+	NATIVE_HEADERS(HEADER_ENTRY)
+#undef HEADER_ENTRY
+};
+
+__attribute__((noreturn)) static void
+die(char * msg)
+{
+	fprintf(stderr, "Error: %s\n", msg);
+	exit(1);
+}
+
+__attribute__((format(printf, 1, 2))) static char *
+format_string(const char * format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	char * string = length < 0 ? NULL : malloc(length + 1);
+	if (!string)
+		die("Failed to allocate string");
+	va_start(args, format);
+	vsnprintf(string, length + 1, format, args);
+	va_end(args);
+	return string;
+}
+
+static FILE *
+open_output(char ** buffer, size_t * size)
+{
+	FILE * out = open_memstream(buffer, size);
+	if (!out)
+		die("Failed to allocate C output");
+	return out;
+}
+
+// Emitter: names, layouts and resolutions go to data, which comes first in the output, and each function is
+// written to functions once it's done, so nested definitions' functions come before the ones that use them.
+// Every expression leaves its value in a WidthInteger chosen by the parent, like registers in bytecode.c.
+
+typedef struct {
+	const void *key;
+	uint32_t id;
+} PointerId;
+
+// Ids for names and layouts, which are shared by pointer
+typedef struct {
+	PointerId *entries;
+	size_t count, capacity;
+} PointerIds;
+
+static size_t
+pointer_hash(const void * key)
+{
+	uint64_t hash = (uintptr_t) key * 0x9e3779b97f4a7c15ULL;
+	return hash ^ (hash >> 29);
+}
+
+// Returns true with the id of a known key, or gives the key the next id
+static bool
+pointer_id(PointerIds * ids, const void * key, uint32_t * id)
+{
+	if ((ids->count + 1) << 1 > ids->capacity) {
+		size_t capacity = ids->capacity ? ids->capacity << 1 : 64;
+		PointerId * entries = calloc(capacity, sizeof(PointerId));
+		if (!entries)
+			die("Failed to allocate C output");
+		for (size_t i = 0; i < ids->capacity; ++i) {
+			if (!ids->entries[i].key)
+				continue;
+			size_t j = pointer_hash(ids->entries[i].key) & (capacity - 1);
+			while (entries[j].key)
+				j = (j + 1) & (capacity - 1);
+			entries[j] = ids->entries[i];
+		}
+		free(ids->entries);
+		ids->entries = entries;
+		ids->capacity = capacity;
+	}
+	size_t i = pointer_hash(key) & (ids->capacity - 1);
+	for (; ids->entries[i].key; i = (i + 1) & (ids->capacity - 1)) {
+		if (ids->entries[i].key == key) {
+			*id = ids->entries[i].id;
+			return true;
+		}
+	}
+	ids->entries[i] = (PointerId) {key, ids->count};
+	*id = ids->count++;
+	return false;
+}
+
+typedef struct {
+	FILE *data, *functions;
+	PointerIds names, layouts;
+	uint32_t variable_count, call_count, params_count, function_count;
+} CEmitter;
+
+typedef struct {
+	CEmitter *emitter;
+	FILE *out;
+	unsigned depth;  // Of indentation
+	uint32_t temp_count;
+	const ScopeLayout *own_layout;  // Of the function's definition, NULL for the program
+	bool restarts;  // A tail call jumps back to the start
+} CFunction;
+
+static void
+line_start(CFunction * function)
+{
+	for (unsigned i = 0; i < function->depth; ++i)
+		fputc('\t', function->out);
+}
+
+__attribute__((format(printf, 2, 3))) static void
+line(CFunction * function, const char * format, ...)
+{
+	line_start(function);
+	va_list args;
+	va_start(args, format);
+	vfprintf(function->out, format, args);
+	va_end(args);
+	fputc('\n', function->out);
+}
+
+// Escapes only what a C string literal can't hold as is
+static char *
+quote_c_string(const char * string)
+{
+	size_t length = strlen(string);
+	char * quoted = malloc(4 * length + 3);
+	if (!quoted)
+		die("Failed to allocate C output");
+	char * p = quoted;
+	*p++ = '"';
+	for (size_t i = 0; i < length; ++i) {
+		unsigned char c = string[i];
+		if (c >= ' ' && c < 0x7f && c != '"' && c != '\\' && c != '?')
+			*p++ = c;
+		else
+			p += sprintf(p, "\\%03o", c);
+	}
+	*p++ = '"';
+	*p = 0;
+	return quoted;
+}
+
+static uint32_t
+emit_name(CEmitter * emitter, const char * name)
+{
+	uint32_t id;
+	if (!pointer_id(&emitter->names, name, &id)) {
+		char * quoted = quote_c_string(name);
+		fprintf(emitter->data, "static char name_%u[] = %s;\n", id, quoted);
+		free(quoted);
+	}
+	return id;
+}
+
+static uint32_t
+emit_layout(CEmitter * emitter, const ScopeLayout * layout)
+{
+	uint32_t id;
+	if (pointer_id(&emitter->layouts, layout, &id))
+		return id;
+	if (!layout->slot_count) {
+		fprintf(emitter->data, "static const ScopeLayout layout_%u = {0, NULL};\n", id);
+		return id;
+	}
+	for (uint32_t i = 0; i < layout->slot_count; ++i)
+		emit_name(emitter, layout->names[i]);
+	fprintf(emitter->data, "static char *layout_%u_names[] = {", id);
+	for (uint32_t i = 0; i < layout->slot_count; ++i)
+		fprintf(emitter->data, "%sname_%u", i ? ", " : "", emit_name(emitter, layout->names[i]));
+	fprintf(emitter->data, "};\nstatic const ScopeLayout layout_%u = {%u, layout_%u_names};\n", id, layout->slot_count, id);
+	return id;
+}
+
+static uint32_t
+emit_variable(CEmitter * emitter, const VariableResolution * resolution)
+{
+	uint32_t name = emit_name(emitter, resolution->name);
+	uint32_t id = emitter->variable_count++;
+	if (!resolution->candidate_count) {
+		fprintf(emitter->data, "static const VariableResolution variable_%u = {name_%u, 0, NULL, %u};\n", id, name, resolution->unit_depth);
+		return id;
+	}
+	fprintf(emitter->data, "static ScopeSlotRef variable_%u_candidates[] = {", id);
+	for (uint32_t i = 0; i < resolution->candidate_count; ++i)
+		fprintf(emitter->data, "%s{%u, %u}", i ? ", " : "", resolution->candidates[i].depth, resolution->candidates[i].slot);
+	fprintf(emitter->data, "};\nstatic const VariableResolution variable_%u = {name_%u, %u, variable_%u_candidates, %u};\n",
+		id, name, resolution->candidate_count, id, resolution->unit_depth);
+	return id;
+}
+
+// Returns an initializer for the ArgumentsDef
+static char *
+emit_params(CEmitter * emitter, ArgumentsDef params)
+{
+	if (!params.entries)
+		return format_string("{%llu, NULL}", (unsigned long long) params.length);
+	uint32_t id = emitter->params_count++;
+	for (uint64_t i = 0; i < params.length; ++i)
+		emit_name(emitter, params.entries[i].name);
+	fprintf(emitter->data, "static ArgumentsDefEntry params_%u[] = {", id);
+	for (uint64_t i = 0; i < params.length; ++i)
+		fprintf(emitter->data, "%s{name_%u}", i ? ", " : "", emit_name(emitter, params.entries[i].name));
+	fprintf(emitter->data, "};\n");
+	return format_string("{%llu, params_%u}", (unsigned long long) params.length, id);
+}
+
+static uint32_t
+new_temp(CFunction * function)
+{
+	uint32_t temp = function->temp_count++;
+	line(function, "WidthInteger v%u;", temp);
+	return temp;
+}
+
+// Scopes without slots are elided, like scope_enter does
+static void
+emit_scope_push(CFunction * function, const ScopeLayout * layout)
+{
+	if (layout->slot_count)
+		line(function, "scope_push(ctx, &layout_%u);", emit_layout(function->emitter, layout));
+}
+
+static void
+emit_scope_pop(CFunction * function, const ScopeLayout * layout)
+{
+	if (layout->slot_count)
+		line(function, "scope_pop(ctx);");
+}
+
+static uint32_t emit_function(CEmitter * emitter, const ExprNode * body, const ScopeLayout * own_layout);
+
+static void
+emit_expression(CFunction * function, const ExprNode * expr, uint32_t dst)
+{
+	CEmitter * emitter = function->emitter;
+	if (!expr) {
+		// The parser may leave out an unfinished last operand
+		line(function, "die(\"Incomplete expression\");");
+		return;
+	}
+	switch (expr->node_type) {
+	case EXPRNODE_FunctionApplication: {
+		const FunctionApplicationExprNode * self = &expr->as_FunctionApplication;
+		if (self->arg_count != self->func->args_def.length) {
+			line(function, "die(\"Wrong argument count\");");
+			break;
+		}
+		uint32_t args[BUILTIN_MAX_ARG_COUNT];
+		line(function, "{");
+		++function->depth;
+		for (uint64_t i = 0; i < self->arg_count; ++i) {
+			args[i] = new_temp(function);
+			emit_expression(function, &self->args[i], args[i]);
+		}
+		line_start(function);
+		fprintf(function->out, "Argtype_%s args = {", self->func->name);
+		for (uint64_t i = 0; i < self->arg_count; ++i)
+			fprintf(function->out, "%sv%u", i ? ", " : "", args[i]);
+		fprintf(function->out, "};\n");
+		line(function, "v%u = native_%s(ctx, &args);", dst, self->func->name);
+		--function->depth;
+		line(function, "}");
+	} break;
+	case EXPRNODE_ShortCircuit: {
+		const ShortCircuitExprNode * self = &expr->as_ShortCircuit;
+		emit_expression(function, &self->args[0], dst);
+		line(function, "if ((bool) v%u.value == %d) {", dst, self->is_or);
+		line(function, "\tv%u = (WidthInteger) {%d, 1};", dst, self->is_or);
+		line(function, "} else {");
+		++function->depth;
+		emit_expression(function, &self->args[1], dst);
+		line(function, "v%u = (WidthInteger) {(bool) v%u.value, 1};", dst, dst);
+		--function->depth;
+		line(function, "}");
+	} break;
+	case EXPRNODE_Literal:
+		line(function, "v%u = (WidthInteger) {%lluULL, %llu};", dst,
+			(unsigned long long) expr->as_Literal.value.value, (unsigned long long) expr->as_Literal.value.width);
+		break;
+	case EXPRNODE_Assign:
+		emit_expression(function, expr->as_Assign.rhs, dst);
+		line(function, "scope_assign_slot(ctx->scope, %u, v%u);", expr->as_Assign.slot, dst);
+		break;
+	case EXPRNODE_Reassign: {
+		const ReassignExprNode * self = &expr->as_Reassign;
+		emit_expression(function, self->rhs, dst);
+		uint32_t variable = emit_variable(emitter, &self->resolution);
+		line(function, "{");
+		++function->depth;
+		line(function, "WidthInteger *ptr = scope_find_variable(ctx->scope, &variable_%u);", variable);
+		line(function, "if (ptr)");
+		line(function, "\t*ptr = v%u;", dst);
+		line(function, "else");
+		line(function, "\tscope_assign_slot(scope_find_root(ctx->scope), %u, v%u);", self->root_slot, dst);
+		--function->depth;
+		line(function, "}");
+	} break;
+	case EXPRNODE_Variable: {
+		uint32_t variable = emit_variable(emitter, &expr->as_Variable.resolution);
+		line(function, "{");
+		++function->depth;
+		line(function, "WidthInteger *ptr = scope_find_variable(ctx->scope, &variable_%u);", variable);
+		line(function, "if (!ptr)");
+		line(function, "\tdie(\"Variable not found\");");
+		line(function, "v%u = *ptr;", dst);
+		--function->depth;
+		line(function, "}");
+	} break;
+	case EXPRNODE_StatementList: {
+		const StatementListExprNode * self = &expr->as_StatementList;
+		if (!self->length)
+			line(function, "v%u = (WidthInteger) {0, 0};", dst);
+		for (uint64_t i = 0; i < self->length; ++i)
+			emit_expression(function, &self->args[i], dst);
+	} break;
+	case EXPRNODE_LoopWhile: {
+		const LoopWhileExprNode * self = &expr->as_LoopWhile;
+		line(function, "v%u = (WidthInteger) {0, 0};", dst);
+		emit_scope_push(function, &self->layout);
+		line(function, "{");
+		++function->depth;
+		uint32_t condition = new_temp(function);
+		line(function, "while (true) {");
+		++function->depth;
+		emit_expression(function, self->condition, condition);
+		line(function, "if (!v%u.value)", condition);
+		line(function, "\tbreak;");
+		emit_expression(function, self->body, dst);
+		--function->depth;
+		line(function, "}");
+		--function->depth;
+		line(function, "}");
+		emit_scope_pop(function, &self->layout);
+	} break;
+	case EXPRNODE_LoopRepeat: {
+		const LoopRepeatExprNode * self = &expr->as_LoopRepeat;
+		line(function, "v%u = (WidthInteger) {0, 0};", dst);
+		emit_scope_push(function, &self->layout);
+		line(function, "{");
+		++function->depth;
+		uint32_t count = new_temp(function);
+		emit_expression(function, self->count, count);
+		line(function, "for (uint64_t i%u = 0; i%u < v%u.value; ++i%u) {", count, count, count, count);
+		++function->depth;
+		if (self->index_name)
+			line(function, "scope_assign_slot(ctx->scope, %u, (WidthInteger) {i%u, 64});", self->index_slot, count);
+		emit_expression(function, self->body, dst);
+		--function->depth;
+		line(function, "}");
+		--function->depth;
+		line(function, "}");
+		emit_scope_pop(function, &self->layout);
+	} break;
+	case EXPRNODE_CondIf: {
+		const CondIfExprNode * self = &expr->as_CondIf;
+		line(function, "v%u = (WidthInteger) {0, 0};", dst);
+		emit_scope_push(function, &self->layout);
+		line(function, "{");
+		++function->depth;
+		uint32_t condition = new_temp(function);
+		emit_expression(function, self->condition, condition);
+		line(function, "if (v%u.value) {", condition);
+		++function->depth;
+		emit_expression(function, self->body, dst);
+		--function->depth;
+		line(function, "}");
+		--function->depth;
+		line(function, "}");
+		emit_scope_pop(function, &self->layout);
+	} break;
+	case EXPRNODE_Switch: {
+		const SwitchExprNode * self = &expr->as_Switch;
+		line(function, "v%u = (WidthInteger) {0, 0};", dst);
+		emit_scope_push(function, &self->layout);
+		line(function, "{");
+		++function->depth;
+		uint32_t value = new_temp(function);
+		emit_expression(function, self->value, value);
+		// The C compiler picks the dispatch
+		line(function, "switch (v%u.value) {", value);
+		for (uint64_t i = 0; i < self->case_count; ++i) {
+			// The first of repeated labels wins, C doesn't take them twice
+			if (switch_find_case(self, self->labels[i]) != i)
+				continue;
+			line(function, "case %lluULL: {", (unsigned long long) self->labels[i]);
+			++function->depth;
+			emit_expression(function, &self->bodies[i], dst);
+			line(function, "break;");
+			--function->depth;
+			line(function, "}");
+		}
+		if (self->has_default) {
+			line(function, "default: {");
+			++function->depth;
+			emit_expression(function, &self->bodies[self->case_count], dst);
+			line(function, "break;");
+			--function->depth;
+			line(function, "}");
+		}
+		line(function, "}");
+		--function->depth;
+		line(function, "}");
+		emit_scope_pop(function, &self->layout);
+	} break;
+	case EXPRNODE_UserFunctionCall: {
+		const UserFunctionCallExprNode * self = &expr->as_UserFunctionCall;
+		// Functions are bound by name when the call runs, like in the interpreters, each call site caches its node
+		uint32_t call = emitter->call_count++;
+		fprintf(emitter->data, "static struct userfunclist_node *call_%u;\n", call);
+		char * name = quote_c_string(self->name);
+		line(function, "{");
+		++function->depth;
+		line(function, "struct userfunclist_node *node = call_%u;", call);
+		line(function, "if (!node) {");
+		line(function, "\tnode = userfunclist_find_function(&ctx->user_functions, %s);", name);
+		line(function, "\tif (!node)");
+		line(function, "\t\tdie(\"User function is not defined\");");
+		line(function, "\tcall_%u = node;", call);
+		line(function, "}");
+		// Taken before the arguments run, which may redefine the function
+		line(function, "const struct userfunc_definition *func = node->definition;");
+		line(function, "if (func->args_def.length != %llu)", (unsigned long long) self->arg_count);
+		line(function, "\tdie(\"Wrong argument count\");");
+		free(name);
+		uint32_t * args = malloc((self->arg_count ? self->arg_count : 1) * sizeof(uint32_t));
+		if (!args)
+			die("Failed to allocate C output");
+		for (uint64_t i = 0; i < self->arg_count; ++i) {
+			args[i] = new_temp(function);
+			emit_expression(function, &self->args[i], args[i]);
+		}
+		if (self->tail_layout && self->tail_layout == function->own_layout) {
+			// The running call's scope takes the new arguments, the same test as the interpreters' tail calls
+			line(function, "if (func->layout == &layout_%u) {", emit_layout(emitter, self->tail_layout));
+			++function->depth;
+			for (uint64_t i = 0; i < self->arg_count; ++i)
+				line(function, "scope_assign_slot(ctx->scope, %llu, v%u);", (unsigned long long) i, args[i]);
+			line(function, "goto start;");
+			--function->depth;
+			line(function, "}");
+			function->restarts = true;
+		}
+		line(function, "const ScopeLayout *layout = func->layout;");
+		line(function, "scope_enter(ctx, layout);");
+		for (uint64_t i = 0; i < self->arg_count; ++i)
+			line(function, "scope_assign_slot(ctx->scope, %llu, v%u);", (unsigned long long) i, args[i]);
+		free(args);
+		line(function, "v%u = func->native(ctx);", dst);
+		line(function, "scope_leave(ctx, layout);");
+		--function->depth;
+		line(function, "}");
+	} break;
+	case EXPRNODE_InlinedCall: {
+		const InlinedCallExprNode * self = &expr->as_InlinedCall;
+		line(function, "{");
+		++function->depth;
+		uint32_t * args = malloc((self->params.length ? self->params.length : 1) * sizeof(uint32_t));
+		if (!args)
+			die("Failed to allocate C output");
+		for (uint64_t i = 0; i < self->params.length; ++i) {
+			args[i] = new_temp(function);
+			emit_expression(function, &self->args[i], args[i]);
+		}
+		emit_scope_push(function, &self->layout);
+		for (uint64_t i = 0; i < self->params.length; ++i)
+			line(function, "scope_assign_slot(ctx->scope, %llu, v%u);", (unsigned long long) i, args[i]);
+		free(args);
+		emit_expression(function, self->body, dst);
+		emit_scope_pop(function, &self->layout);
+		--function->depth;
+		line(function, "}");
+	} break;
+	case EXPRNODE_UserFunctionDef: {
+		const UserFunctionDefExprNode * self = &expr->as_UserFunctionDef;
+		uint32_t defined = emit_function(emitter, self->body, &self->layout);
+		uint32_t layout = emit_layout(emitter, &self->layout);
+		char * name = quote_c_string(self->name ? self->name : "");
+		char * params = emit_params(emitter, self->args);
+		fprintf(emitter->data, "static WidthInteger function_%u(InterpContext * ctx);\n", defined);
+		fprintf(emitter->data, "static const struct userfunc_definition definition_%u = {NULL, %s, &layout_%u, NULL, function_%u};\n",
+			defined, params, layout, defined);
+		line(function, "userfunclist_add_function(&ctx->user_functions, %s, &definition_%u);", name, defined);
+		line(function, "v%u = (WidthInteger) {0, 0};", dst);
+		free(name);
+		free(params);
+	} break;
+	}
+}
+
+static uint32_t
+emit_function(CEmitter * emitter, const ExprNode * body, const ScopeLayout * own_layout)
+{
+	uint32_t id = emitter->function_count++;
+	char * code = NULL;
+	size_t code_size = 0;
+	CFunction function = {
+		.emitter = emitter,
+		.out = open_output(&code, &code_size),
+		.depth = 1,
+		.own_layout = own_layout,
+	};
+	uint32_t result = new_temp(&function);
+	emit_expression(&function, body, result);
+	line(&function, "return v%u;", result);
+	fclose(function.out);
+	fprintf(emitter->functions, "static WidthInteger\nfunction_%u(InterpContext * ctx)\n{\n", id);
+	if (own_layout) {
+		// User functions may recurse, the program itself runs once
+		fprintf(emitter->functions, "\tif ((char *) __builtin_frame_address(0) < native_stack_limit)\n");
+		fprintf(emitter->functions, "\t\tdie(\"Calls nested too deep for the native stack\");\n");
+	}
+	if (function.restarts)
+		fprintf(emitter->functions, "start:;\n");
+	fputs(code, emitter->functions);
+	fprintf(emitter->functions, "}\n\n");
+	free(code);
+	return id;
+}
+
+static const char c_prelude[] =
+	"// Generated by bitstreamop --emit-c\n"
+	"#include \"interp_types.h\"\n"
+	"#include \"functions.h\"\n"
+	"#include \"function_support.h\"\n"
+	"\n"
+	"#include <errno.h>\n"
+	"#include <pthread.h>\n"
+	"\n"
+	"// User function calls recurse on the C stack, so the program runs on a large one of its own\n"
+	"// and calls die before they get within the margin of its end\n"
+	"#define NATIVE_STACK_SIZE ((size_t) 1 << 30)\n"
+	"#define NATIVE_STACK_MIN_SIZE ((size_t) 1 << 24)\n"
+	"#define NATIVE_STACK_MARGIN ((size_t) 1 << 18)\n"
+	"static char *native_stack_limit;\n"
+	"\n"
+	"#define BITSTREAMOP_FUNCTION(name, effects, arglist, body) \\\n"
+	"\t__attribute__((unused)) inline static WidthInteger \\\n"
+	"\tnative_##name(InterpContext * context, Argtype_##name * args) { (void) context; (void) args; UNPACK body }\n"
+	"#include \"functions.cc\"\n"
+	"#undef BITSTREAMOP_FUNCTION\n"
+	"\n";
+
+static const char c_entry[] =
+	"\n"
+	"WidthInteger bitstreamop_native_run(InterpContext * ctx);\n"
+	"\n"
+	"typedef struct {\n"
+	"\tInterpContext *ctx;\n"
+	"\tsize_t stack_size;\n"
+	"\tWidthInteger result;\n"
+	"} NativeRun;\n"
+	"\n"
+	"static void *\n"
+	"run_on_native_stack(void * data)\n"
+	"{\n"
+	"\tNativeRun *run = data;\n"
+	"\tnative_stack_limit = (char *) __builtin_frame_address(0) - run->stack_size + NATIVE_STACK_MARGIN;\n"
+	"\tscope_push(run->ctx, &layout_%u);\n"
+	"\trun->result = function_%u(run->ctx);\n"
+	"\tscope_pop(run->ctx);\n"
+	"\treturn NULL;\n"
+	"}\n"
+	"\n"
+	"WidthInteger\n"
+	"bitstreamop_native_run(InterpContext * ctx)\n"
+	"{\n"
+	"\tNativeRun run = {ctx, NATIVE_STACK_SIZE, {0, 0}};\n"
+	"\tpthread_attr_t attr;\n"
+	"\tpthread_t thread;\n"
+	"\tint error;\n"
+	"\t// Settle for less where address space or memory is short\n"
+	"\twhile (true) {\n"
+	"\t\tif (pthread_attr_init(&attr) || pthread_attr_setstacksize(&attr, run.stack_size))\n"
+	"\t\t\tdie(\"Failed to set up the native stack\");\n"
+	"\t\terror = pthread_create(&thread, &attr, &run_on_native_stack, &run);\n"
+	"\t\tpthread_attr_destroy(&attr);\n"
+	"\t\tif (!error)\n"
+	"\t\t\tbreak;\n"
+	"\t\tif ((error != EAGAIN && error != ENOMEM) || run.stack_size <= NATIVE_STACK_MIN_SIZE)\n"
+	"\t\t\tdie(\"Failed to start the native program\");\n"
+	"\t\trun.stack_size >>= 1;\n"
+	"\t}\n"
+	"\tpthread_join(thread, NULL);\n"
+	"\treturn run.result;\n"
+	"}\n"
+	"\n"
+	"#ifdef BITSTREAMOP_NATIVE_MAIN\n"
+	"#include <unistd.h>\n"
+	"\n"
+	"int\n"
+	"main(void)\n"
+	"{\n"
+	"\tBitIO io_in = fd_to_bit_io(STDIN_FILENO, 1 << 16, 0);\n"
+	"\tBitIO io_out = fd_to_bit_io(STDOUT_FILENO, 0, 1 << 16);\n"
+	"\tbit_io_map_input(&io_in);\n"
+	"\tInterpContext ctx = {\n"
+	"\t\t.io_in = &io_in,\n"
+	"\t\t.io_out = &io_out,\n"
+	"\t};\n"
+	"\tbitstreamop_native_run(&ctx);\n"
+	"\tbit_io_flush(&io_out);\n"
+	"\tfree_bit_io(io_in);\n"
+	"\tfree_bit_io(io_out);\n"
+	"\tscope_pool_clear(&ctx);\n"
+	"\tuserfunclist_clear(&ctx.user_functions);\n"
+	"\treturn 0;\n"
+	"}\n"
+	"#endif\n";
+
+void
+emit_c(FILE * out, const ExprNode * program, const ScopeLayout * root_layout)
+{
+	char *data = NULL, *functions = NULL;
+	size_t data_size = 0, functions_size = 0;
+	CEmitter emitter = {
+		.data = open_output(&data, &data_size),
+		.functions = open_output(&functions, &functions_size),
+	};
+	uint32_t root = emit_layout(&emitter, root_layout);
+	uint32_t main_function = emit_function(&emitter, program, NULL);
+	fclose(emitter.data);
+	fclose(emitter.functions);
+	fputs(c_prelude, out);
+	fputs(data, out);
+	fputc('\n', out);
+	fputs(functions, out);
+	fprintf(out, c_entry, root, main_function);
+	free(data);
+	free(functions);
+	free(emitter.names.entries);
+	free(emitter.layouts.entries);
+}
+
+// mkdir -p, private to the user since what's built there gets loaded
+static void
+make_directories(char * path)
+{
+	for (char * p = path + 1;; ++p) {
+		if (*p && *p != '/')
+			continue;
+		char c = *p;
+		*p = 0;
+		if (mkdir(path, 0700) && errno != EEXIST) {
+			fprintf(stderr, "Error: Failed to create %s: %s\n", path, strerror(errno));
+			exit(1);
+		}
+		*p = c;
+		if (!c)
+			break;
+	}
+}
+
+// Whoever else can write there could have their code loaded instead of the program's
+static void
+check_private(const char * path)
+{
+	struct stat st;
+	if (stat(path, &st)) {
+		fprintf(stderr, "Error: Failed to check %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		fprintf(stderr, "Error: %s has to be owned by the user and not writable by group or others\n", path);
+		exit(1);
+	}
+}
+
+static char *
+cache_directory(void)
+{
+	const char * dir;
+	char * path;
+	if ((dir = getenv("BITSTREAMOP_CACHE_DIR")) && *dir)
+		path = format_string("%s", dir);
+	else if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+		path = format_string("%s/bitstreamop", dir);
+	else if ((dir = getenv("HOME")) && *dir)
+		path = format_string("%s/.cache/bitstreamop", dir);
+	else
+		die("No cache directory for native code, set BITSTREAMOP_CACHE_DIR");
+	make_directories(path);
+	check_private(path);
+	return path;
+}
+
+static bool
+file_has_contents(const char * path, const char * data, size_t size)
+{
+	FILE * file = fopen(path, "r");
+	if (!file)
+		return false;
+	bool same = true;
+	char buffer[1 << 12];
+	size_t offset = 0, read_bytes;
+	while (same && (read_bytes = fread(buffer, 1, sizeof(buffer), file))) {
+		same = read_bytes <= size - offset && !memcmp(buffer, data + offset, read_bytes);
+		offset += read_bytes;
+	}
+	same = same && !ferror(file) && offset == size;
+	fclose(file);
+	return same;
+}
+
+// Written under a name of its own and renamed, so concurrent runs never see half a file
+static void
+write_file(const char * path, const char * data, size_t size)
+{
+	char * temp_path = format_string("%s.%ld", path, (long) getpid());
+	FILE * file = fopen(temp_path, "w");
+	if (!file || fwrite(data, 1, size, file) != size || fclose(file) || rename(temp_path, path)) {
+		fprintf(stderr, "Error: Failed to write %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	free(temp_path);
+}
+
+// Returns the directory with the embedded headers, named by their hash so builds with other headers get their own
+static char *
+header_directory(const char * cache_dir)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < sizeof(native_headers) / sizeof(native_headers[0]); ++i) {
+		const EmbeddedHeader * header = &native_headers[i];
+		hash = (hash ^ name_hash(header->name, strlen(header->name))) * 0x100000001b3ULL;
+		hash = (hash ^ name_hash(header->data, header->end - header->data)) * 0x100000001b3ULL;
+	}
+	char * path = format_string("%s/headers-%016llx", cache_dir, (unsigned long long) hash);
+	make_directories(path);
+	check_private(path);
+	for (size_t i = 0; i < sizeof(native_headers) / sizeof(native_headers[0]); ++i) {
+		const EmbeddedHeader * header = &native_headers[i];
+		char * header_path = format_string("%s/%s", path, header->name);
+		if (!file_has_contents(header_path, header->data, header->end - header->data))
+			write_file(header_path, header->data, header->end - header->data);
+		free(header_path);
+	}
+	return path;
+}
+
+static bool
+build_shared_object(const char * cc, const char * include_dir, const char * source_path, const char * object_path)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+		return false;
+	if (!pid) {
+		// Stdout may carry the program's output
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		execlp(cc, cc, "-O2", "-w", "-shared", "-fPIC", "-pthread", "-I", include_dir, "-o", object_path, source_path, (char *) NULL);
+		perror(cc);
+		_exit(127);
+	}
+	int status;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR)
+			return false;
+	}
+	return WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+typedef WidthInteger (*NativeEntry)(InterpContext * ctx);
+
+WidthInteger
+run_native(InterpContext * ctx, const ExprNode * program, const ScopeLayout * root_layout)
+{
+	const char * cc = getenv("CC");
+	if (!cc || !*cc)
+		cc = "cc";
+	char * dir = cache_directory();
+	char * include_dir = header_directory(dir);
+	char * source = NULL;
+	size_t source_size = 0;
+	FILE * out = open_output(&source, &source_size);
+	// The object depends on the compiler and the headers too, naming them makes them part of what's compared
+	char * quoted_cc = quote_c_string(cc);
+	char * quoted_include_dir = quote_c_string(include_dir);
+	fprintf(out, "// Built with %s against %s\n", quoted_cc, quoted_include_dir);
+	free(quoted_cc);
+	free(quoted_include_dir);
+	emit_c(out, program, root_layout);
+	fclose(out);
+
+	// The names are only a hash, so the object is used only if the source kept next to it is the same
+	uint64_t key = name_hash(source, source_size);
+	char * source_path = format_string("%s/%016llx.c", dir, (unsigned long long) key);
+	char * object_path = format_string("%s/%016llx.so", dir, (unsigned long long) key);
+	if (!file_has_contents(source_path, source, source_size) || access(object_path, R_OK)) {
+		// Built under names of their own and renamed, so concurrent runs never load half an object
+		char * build_source_path = format_string("%s/%016llx.%ld.c", dir, (unsigned long long) key, (long) getpid());
+		char * build_path = format_string("%s/%016llx.%ld.so", dir, (unsigned long long) key, (long) getpid());
+		FILE * file = fopen(build_source_path, "w");
+		if (!file || fwrite(source, 1, source_size, file) != source_size || fclose(file))
+			die("Failed to write the native program's C");
+		if (!build_shared_object(cc, include_dir, build_source_path, build_path)) {
+			unlink(build_source_path);
+			unlink(build_path);
+			die("Failed to build the native program");
+		}
+		// The old source goes first, so no run pairs it with the new object
+		unlink(source_path);
+		if (rename(build_path, object_path) || rename(build_source_path, source_path))
+			die("Failed to store the native program");
+		free(build_source_path);
+		free(build_path);
+	}
+	free(source);
+	free(source_path);
+	free(include_dir);
+	free(dir);
+
+	check_private(object_path);
+	void * handle = dlopen(object_path, RTLD_NOW | RTLD_LOCAL);
+	free(object_path);
+	if (!handle) {
+		fprintf(stderr, "Error: %s\n", dlerror());
+		exit(1);
+	}
+	NativeEntry entry = (NativeEntry) dlsym(handle, "bitstreamop_native_run");
+	if (!entry)
+		die("Native program has no entry point");
+	WidthInteger result = entry(ctx);
+	// The registry may still point into the object, it's only freed at exit
+	return result;
+}
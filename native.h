@@ -0,0 +1,18 @@
+#ifndef NATIVE_H_
+#define NATIVE_H_
+
+#include <stdio.h>
+
+#include "expression.h"
+
+// Writes the resolved program as a C translation unit. It runs on the same scopes and user function registry as
+// the interpreters, with the builtins from functions.cc, and defines bitstreamop_native_run(InterpContext *).
+// Built with -D BITSTREAMOP_NATIVE_MAIN and linked with bitio*.c it's a filter from stdin to stdout.
+void emit_c(FILE * out, const ExprNode * program, const ScopeLayout * root_layout);
+
+// Builds the program's C with $CC (cc by default) into a shared object cached by its hash, loads it and runs it.
+// The cache is $BITSTREAMOP_CACHE_DIR, or bitstreamop in $XDG_CACHE_HOME or ~/.cache, which also gets the headers
+// the C includes from a copy built into the executable.
+WidthInteger run_native(InterpContext * ctx, const ExprNode * program, const ScopeLayout * root_layout);
+
+#endif /* end of include guard: NATIVE_H_ */
@@ -0,0 +1,543 @@
+#include "optimizer.h"
+#include "functions.h"
+#include "common.h"
+#include "name_table.h"
+
+#include <string.h>
+
+static void
+free_child(ExprNode * child)
+{
+	if (!child)
+		return;
+	destruct_expression(child);
+	free(child);
+}
+
+// Replaces the contents of expr, which has to be destructed already
+static void
+make_literal(ExprNode * expr, WidthInteger value)
+{
+	expr->node_type = EXPRNODE_Literal;
+	expr->as_Literal.value = value;
+}
+
+static bool
+is_literal(const ExprNode * expr)
+{
+	return expr && expr->node_type == EXPRNODE_Literal;
+}
+
+static void
+fold_function_application(ExprNode * expr)
+{
+	FunctionApplicationExprNode * self = &expr->as_FunctionApplication;
+	if (self->func->effects != FUNCTION_PURE)
+		return;
+	// Wrong counts are reported when the call is reached
+	if (self->arg_count != self->func->args_def.length)
+		return;
+	WidthInteger args[BUILTIN_MAX_ARG_COUNT];
+	for (uint64_t i = 0; i < self->arg_count; ++i) {
+		if (!is_literal(&self->args[i]))
+			return;
+		args[i] = self->args[i].as_Literal.value;
+	}
+	// Pure builtins don't use the context
+	WidthInteger value = self->func->impl(NULL, args);
+	destruct_expression(expr);
+	make_literal(expr, value);
+}
+
+// A literal first operand may decide the result alone, the second one is never evaluated then
+static void
+fold_short_circuit(ExprNode * expr)
+{
+	ShortCircuitExprNode * self = &expr->as_ShortCircuit;
+	if (!is_literal(&self->args[0]))
+		return;
+	bool lhs = self->args[0].as_Literal.value.value;
+	WidthInteger value;
+	if (lhs == self->is_or) {
+		value = (WidthInteger) {self->is_or, 1};
+	} else if (is_literal(&self->args[1])) {
+		value = (WidthInteger) {(bool) self->args[1].as_Literal.value.value, 1};
+	} else {
+		return;
+	}
+	destruct_expression(expr);
+	make_literal(expr, value);
+}
+
+// With a known value, only the selected body is left, in an if that keeps its scope
+static void
+select_switch_case(ExprNode * expr)
+{
+	SwitchExprNode * self = &expr->as_Switch;
+	if (!is_literal(self->value))
+		return;
+	uint64_t selected = switch_find_case(self, self->value->as_Literal.value.value);
+	if (selected >= self->case_count + self->has_default) {
+		destruct_expression(expr);
+		make_literal(expr, (WidthInteger) {0, 0});
+		return;
+	}
+	ExprNode * body = malloc(sizeof(ExprNode));
+	if (!body) {
+		fprintf(stderr, "Failed to allocate expression node\n");
+		exit(1);
+	}
+	*body = self->bodies[selected];  // MOVE contents
+	self->bodies[selected] = (ExprNode) {
+		.node_type = EXPRNODE_Literal,
+		.destructor = NULL,
+	};
+	ExprNode * condition = self->value;
+	condition->as_Literal.value = (WidthInteger) {1, 1};
+	self->value = NULL;
+	destruct_expression(expr);
+	expr->node_type = EXPRNODE_CondIf;
+	expr->as_CondIf = (CondIfExprNode) {
+		.condition = condition,
+		.body = body,
+		.layout = {0, NULL},
+	};
+}
+
+static void
+prune_statement_list(ExprNode * expr)
+{
+	StatementListExprNode * self = &expr->as_StatementList;
+	// Only the last statement gives the list its value, literals before it do nothing
+	uint64_t kept = 0;
+	for (uint64_t i = 0; i < self->length; ++i) {
+		if (i + 1 < self->length && is_literal(&self->args[i])) {
+			destruct_expression(&self->args[i]);
+			continue;
+		}
+		self->args[kept++] = self->args[i];
+	}
+	self->length = kept;
+	if (kept == 1) {
+		// StatementList isn't a scope, so the single statement can take its place
+		ExprNode * args = self->args;
+		*expr = args[0];
+		free(args);
+	}
+}
+
+void
+optimize_expression(ExprNode * expr)
+{
+	// The parser may leave out an unfinished last operand
+	if (!expr)
+		return;
+	switch (expr->node_type) {
+	case EXPRNODE_FunctionApplication:
+		for (uint64_t i = 0; i < expr->as_FunctionApplication.arg_count; ++i)
+			optimize_expression(&expr->as_FunctionApplication.args[i]);
+		fold_function_application(expr);
+		break;
+	case EXPRNODE_ShortCircuit:
+		optimize_expression(&expr->as_ShortCircuit.args[0]);
+		optimize_expression(&expr->as_ShortCircuit.args[1]);
+		fold_short_circuit(expr);
+		break;
+	case EXPRNODE_Literal:
+		break;
+	case EXPRNODE_Assign:
+		optimize_expression(expr->as_Assign.rhs);
+		break;
+	case EXPRNODE_Reassign:
+		optimize_expression(expr->as_Reassign.rhs);
+		break;
+	case EXPRNODE_Variable:
+		break;
+	case EXPRNODE_StatementList:
+		for (uint64_t i = 0; i < expr->as_StatementList.length; ++i)
+			optimize_expression(&expr->as_StatementList.args[i]);
+		prune_statement_list(expr);
+		break;
+	case EXPRNODE_LoopWhile:
+		optimize_expression(expr->as_LoopWhile.condition);
+		optimize_expression(expr->as_LoopWhile.body);
+		// A loop that never runs its body is worth nothing
+		if (is_literal(expr->as_LoopWhile.condition) && !expr->as_LoopWhile.condition->as_Literal.value.value) {
+			free_child(expr->as_LoopWhile.condition);
+			free_child(expr->as_LoopWhile.body);
+			make_literal(expr, (WidthInteger) {0, 0});
+		}
+		break;
+	case EXPRNODE_LoopRepeat:
+		optimize_expression(expr->as_LoopRepeat.count);
+		optimize_expression(expr->as_LoopRepeat.body);
+		if (is_literal(expr->as_LoopRepeat.count) && !expr->as_LoopRepeat.count->as_Literal.value.value) {
+			free_child(expr->as_LoopRepeat.count);
+			free_child(expr->as_LoopRepeat.body);
+			free(expr->as_LoopRepeat.index_name);
+			make_literal(expr, (WidthInteger) {0, 0});
+		}
+		break;
+	case EXPRNODE_CondIf:
+		optimize_expression(expr->as_CondIf.condition);
+		optimize_expression(expr->as_CondIf.body);
+		// A true condition still keeps the node, as its body's assignments belong to its scope
+		if (is_literal(expr->as_CondIf.condition) && !expr->as_CondIf.condition->as_Literal.value.value) {
+			free_child(expr->as_CondIf.condition);
+			free_child(expr->as_CondIf.body);
+			make_literal(expr, (WidthInteger) {0, 0});
+		}
+		break;
+	case EXPRNODE_Switch:
+		optimize_expression(expr->as_Switch.value);
+		for (uint64_t i = 0; i < expr->as_Switch.case_count + expr->as_Switch.has_default; ++i)
+			optimize_expression(&expr->as_Switch.bodies[i]);
+		select_switch_case(expr);
+		break;
+	case EXPRNODE_UserFunctionCall:
+		for (uint64_t i = 0; i < expr->as_UserFunctionCall.arg_count; ++i)
+			optimize_expression(&expr->as_UserFunctionCall.args[i]);
+		break;
+	case EXPRNODE_InlinedCall:
+		for (uint64_t i = 0; i < expr->as_InlinedCall.params.length; ++i)
+			optimize_expression(&expr->as_InlinedCall.args[i]);
+		optimize_expression(expr->as_InlinedCall.body);
+		break;
+	case EXPRNODE_UserFunctionDef:
+		optimize_expression(expr->as_UserFunctionDef.body);
+		break;
+	}
+}
+
+// Inlining
+
+// Bodies up to this many nodes are copied into their calls
+#define INLINE_MAX_BODY_SIZE 24
+
+static void *
+allocate(size_t size)
+{
+	void * ptr = malloc(size);
+	if (!ptr) {
+		fprintf(stderr, "Failed to allocate expression node\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static char *
+copy_name(const char * name)
+{
+	if (!name)
+		return NULL;
+	char * copy = strdup(name);
+	if (!copy) {
+		fprintf(stderr, "Failed to allocate expression node\n");
+		exit(1);
+	}
+	return copy;
+}
+
+static void copy_expression_into(ExprNode * dst, const ExprNode * src);
+
+static ExprNode *
+copy_expression(const ExprNode * src)
+{
+	if (!src)
+		return NULL;
+	ExprNode * dst = allocate(sizeof(ExprNode));
+	copy_expression_into(dst, src);
+	return dst;
+}
+
+static ExprNode *
+copy_expressions(const ExprNode * src, uint64_t count)
+{
+	if (!src)
+		return NULL;
+	ExprNode * dst = allocate((count ? count : 1) * sizeof(ExprNode));
+	for (uint64_t i = 0; i < count; ++i)
+		copy_expression_into(&dst[i], &src[i]);
+	return dst;
+}
+
+static ArgumentsDef
+copy_arguments_def(ArgumentsDef args)
+{
+	ArgumentsDef copy = {args.length, NULL};
+	if (args.entries) {
+		copy.entries = allocate((args.length ? args.length : 1) * sizeof(ArgumentsDefEntry));
+		for (uint64_t i = 0; i < args.length; ++i)
+			copy.entries[i].name = copy_name(args.entries[i].name);
+	}
+	return copy;
+}
+
+// Deep copy of an unresolved expression, resolutions and layouts are left empty for resolve_variables
+static void
+copy_expression_into(ExprNode * dst, const ExprNode * src)
+{
+	*dst = *src;
+	switch (src->node_type) {
+	case EXPRNODE_FunctionApplication:
+		dst->as_FunctionApplication.args = copy_expressions(src->as_FunctionApplication.args, src->as_FunctionApplication.arg_count);
+		break;
+	case EXPRNODE_ShortCircuit:
+		dst->as_ShortCircuit.args = copy_expressions(src->as_ShortCircuit.args, 2);
+		break;
+	case EXPRNODE_Literal:
+		break;
+	case EXPRNODE_Assign:
+		dst->as_Assign.name = copy_name(src->as_Assign.name);
+		dst->as_Assign.rhs = copy_expression(src->as_Assign.rhs);
+		break;
+	case EXPRNODE_Reassign:
+		dst->as_Reassign.name = copy_name(src->as_Reassign.name);
+		dst->as_Reassign.rhs = copy_expression(src->as_Reassign.rhs);
+		break;
+	case EXPRNODE_Variable:
+		dst->as_Variable.name = copy_name(src->as_Variable.name);
+		break;
+	case EXPRNODE_StatementList:
+		dst->as_StatementList.args = copy_expressions(src->as_StatementList.args, src->as_StatementList.length);
+		break;
+	case EXPRNODE_LoopWhile:
+		dst->as_LoopWhile.condition = copy_expression(src->as_LoopWhile.condition);
+		dst->as_LoopWhile.body = copy_expression(src->as_LoopWhile.body);
+		break;
+	case EXPRNODE_LoopRepeat:
+		dst->as_LoopRepeat.count = copy_expression(src->as_LoopRepeat.count);
+		dst->as_LoopRepeat.body = copy_expression(src->as_LoopRepeat.body);
+		dst->as_LoopRepeat.index_name = copy_name(src->as_LoopRepeat.index_name);
+		break;
+	case EXPRNODE_CondIf:
+		dst->as_CondIf.condition = copy_expression(src->as_CondIf.condition);
+		dst->as_CondIf.body = copy_expression(src->as_CondIf.body);
+		break;
+	case EXPRNODE_Switch: {
+		SwitchExprNode * self = &dst->as_Switch;
+		self->value = copy_expression(src->as_Switch.value);
+		self->bodies = copy_expressions(src->as_Switch.bodies, self->case_count + self->has_default);
+		if (src->as_Switch.labels) {
+			self->labels = allocate((self->case_count ? self->case_count : 1) * sizeof(uint64_t));
+			memcpy(self->labels, src->as_Switch.labels, self->case_count * sizeof(uint64_t));
+		}
+		build_switch_dispatch(self);
+	} break;
+	case EXPRNODE_UserFunctionCall:
+		dst->as_UserFunctionCall.name = copy_name(src->as_UserFunctionCall.name);
+		dst->as_UserFunctionCall.args = copy_expressions(src->as_UserFunctionCall.args, src->as_UserFunctionCall.arg_count);
+		dst->as_UserFunctionCall.cached_func = NULL;
+		break;
+	case EXPRNODE_InlinedCall:
+		dst->as_InlinedCall.name = copy_name(src->as_InlinedCall.name);
+		dst->as_InlinedCall.params = copy_arguments_def(src->as_InlinedCall.params);
+		dst->as_InlinedCall.args = copy_expressions(src->as_InlinedCall.args, src->as_InlinedCall.params.length);
+		dst->as_InlinedCall.body = copy_expression(src->as_InlinedCall.body);
+		break;
+	case EXPRNODE_UserFunctionDef:
+		dst->as_UserFunctionDef.name = copy_name(src->as_UserFunctionDef.name);
+		dst->as_UserFunctionDef.args = copy_arguments_def(src->as_UserFunctionDef.args);
+		dst->as_UserFunctionDef.body = copy_expression(src->as_UserFunctionDef.body);
+		break;
+	}
+}
+
+// Calls expr's children in order
+static void
+for_each_child(ExprNode * expr, void (*visit)(ExprNode * child, void * data), void * data)
+{
+	switch (expr->node_type) {
+	case EXPRNODE_FunctionApplication:
+		for (uint64_t i = 0; i < expr->as_FunctionApplication.arg_count; ++i)
+			visit(&expr->as_FunctionApplication.args[i], data);
+		break;
+	case EXPRNODE_ShortCircuit:
+		visit(&expr->as_ShortCircuit.args[0], data);
+		visit(&expr->as_ShortCircuit.args[1], data);
+		break;
+	case EXPRNODE_Literal:
+		break;
+	case EXPRNODE_Assign:
+		visit(expr->as_Assign.rhs, data);
+		break;
+	case EXPRNODE_Reassign:
+		visit(expr->as_Reassign.rhs, data);
+		break;
+	case EXPRNODE_Variable:
+		break;
+	case EXPRNODE_StatementList:
+		for (uint64_t i = 0; i < expr->as_StatementList.length; ++i)
+			visit(&expr->as_StatementList.args[i], data);
+		break;
+	case EXPRNODE_LoopWhile:
+		visit(expr->as_LoopWhile.condition, data);
+		visit(expr->as_LoopWhile.body, data);
+		break;
+	case EXPRNODE_LoopRepeat:
+		visit(expr->as_LoopRepeat.count, data);
+		visit(expr->as_LoopRepeat.body, data);
+		break;
+	case EXPRNODE_CondIf:
+		visit(expr->as_CondIf.condition, data);
+		visit(expr->as_CondIf.body, data);
+		break;
+	case EXPRNODE_Switch:
+		visit(expr->as_Switch.value, data);
+		for (uint64_t i = 0; i < expr->as_Switch.case_count + expr->as_Switch.has_default; ++i)
+			visit(&expr->as_Switch.bodies[i], data);
+		break;
+	case EXPRNODE_UserFunctionCall:
+		for (uint64_t i = 0; i < expr->as_UserFunctionCall.arg_count; ++i)
+			visit(&expr->as_UserFunctionCall.args[i], data);
+		break;
+	case EXPRNODE_InlinedCall:
+		for (uint64_t i = 0; i < expr->as_InlinedCall.params.length; ++i)
+			visit(&expr->as_InlinedCall.args[i], data);
+		visit(expr->as_InlinedCall.body, data);
+		break;
+	case EXPRNODE_UserFunctionDef:
+		visit(expr->as_UserFunctionDef.body, data);
+		break;
+	}
+}
+
+// Calls are bound by name when they run, and definitions may be repeated, nested or not reached yet. So only a
+// function with a single definition, which is a statement of the program itself, is inlined, and only into the
+// statements after that one. Its body mustn't call or define user functions, which also rules out recursion.
+
+typedef struct {
+	const UserFunctionDefExprNode *def;  // The first one seen
+	size_t def_count;
+	bool inlinable;  // Its statement has been passed and its body qualifies
+} InlineFunction;
+
+typedef struct {
+	InlineFunction *functions;
+	size_t count;
+	NameTable names;
+} Inliner;
+
+static void
+count_definitions(ExprNode * expr, void * data)
+{
+	if (!expr)
+		return;
+	if (expr->node_type == EXPRNODE_UserFunctionDef)
+		++*(size_t *) data;
+	for_each_child(expr, count_definitions, data);
+}
+
+static void
+collect_definitions(ExprNode * expr, void * data)
+{
+	if (!expr)
+		return;
+	Inliner * inliner = data;
+	if (expr->node_type == EXPRNODE_UserFunctionDef && expr->as_UserFunctionDef.name) {
+		const UserFunctionDefExprNode * def = &expr->as_UserFunctionDef;
+		size_t index;
+		if (name_table_find(&inliner->names, def->name, strlen(def->name), &index)) {
+			++inliner->functions[index].def_count;
+		} else {
+			inliner->functions[inliner->count] = (InlineFunction) {def, 1, false};
+			name_table_insert(&inliner->names, def->name, inliner->count++);
+		}
+	}
+	for_each_child(expr, collect_definitions, data);
+}
+
+typedef struct {
+	size_t size;
+	bool calls;
+} BodyStats;
+
+static void
+measure_body(ExprNode * expr, void * data)
+{
+	BodyStats * stats = data;
+	// A missing operand dies when it's reached, which is left to a regular call
+	if (!expr || expr->node_type == EXPRNODE_UserFunctionCall || expr->node_type == EXPRNODE_UserFunctionDef) {
+		stats->calls = true;
+		return;
+	}
+	++stats->size;
+	for_each_child(expr, measure_body, data);
+}
+
+static void
+inline_calls(ExprNode * expr, void * data)
+{
+	if (!expr)
+		return;
+	Inliner * inliner = data;
+	for_each_child(expr, inline_calls, data);
+	if (expr->node_type != EXPRNODE_UserFunctionCall)
+		return;
+	UserFunctionCallExprNode * self = &expr->as_UserFunctionCall;
+	size_t index;
+	if (!self->name || !name_table_find(&inliner->names, self->name, strlen(self->name), &index))
+		return;
+	const InlineFunction * function = &inliner->functions[index];
+	// Wrong counts are reported when the call is reached
+	if (!function->inlinable || self->arg_count != function->def->args.length)
+		return;
+	ExprNode * args = self->args;  // MOVE
+	if (!args)
+		args = allocate(sizeof(ExprNode));
+	char * name = self->name;  // MOVE
+	expr->node_type = EXPRNODE_InlinedCall;
+	expr->as_InlinedCall = (InlinedCallExprNode) {
+		.name = name,
+		.params = copy_arguments_def(function->def->args),
+		.args = args,
+		.body = copy_expression(function->def->body),
+		.layout = {0, NULL},
+	};
+}
+
+void
+inline_user_functions(ExprNode * program)
+{
+	size_t def_count = 0;
+	count_definitions(program, &def_count);
+	if (!def_count)
+		return;
+	size_t capacity = 4;
+	while (capacity <= def_count * 2)
+		capacity <<= 1;
+	Inliner inliner = {
+		.functions = allocate(def_count * sizeof(InlineFunction)),
+		.count = 0,
+		.names = {capacity - 1, calloc(capacity, sizeof(NameTableSlot))},
+	};
+	if (!inliner.names.slots) {
+		fprintf(stderr, "Failed to allocate expression node\n");
+		exit(1);
+	}
+	collect_definitions(program, &inliner);
+
+	uint64_t length = 1;
+	ExprNode * statements = program;
+	if (program->node_type == EXPRNODE_StatementList) {
+		length = program->as_StatementList.length;
+		statements = program->as_StatementList.args;
+	}
+	for (uint64_t i = 0; i < length; ++i) {
+		ExprNode * statement = &statements[i];
+		// A definition's body gets the calls of earlier functions inlined before it's measured
+		inline_calls(statement, &inliner);
+		if (statement->node_type != EXPRNODE_UserFunctionDef || !statement->as_UserFunctionDef.name)
+			continue;
+		const UserFunctionDefExprNode * def = &statement->as_UserFunctionDef;
+		size_t index;
+		if (!name_table_find(&inliner.names, def->name, strlen(def->name), &index))
+			continue;
+		InlineFunction * function = &inliner.functions[index];
+		BodyStats stats = {0, false};
+		measure_body(def->body, &stats);
+		function->inlinable = function->def_count == 1 && !stats.calls && stats.size <= INLINE_MAX_BODY_SIZE;
+	}
+	free(inliner.functions);
+	free(inliner.names.slots);
+}
@@ -0,0 +1,12 @@
+#ifndef OPTIMIZER_H_
+#define OPTIMIZER_H_
+
+#include "expression.h"
+
+// Folds builtin calls on literals and drops code that can't run or has no effect.
+// Runs on the parsed program before resolve_variables, as it may remove scopes' assignments.
+void optimize_expression(ExprNode * expr);
+// Replaces calls of small, non-recursive user functions with copies of their bodies, after optimize_expression
+void inline_user_functions(ExprNode * program);
+
+#endif /* end of include guard: OPTIMIZER_H_ */
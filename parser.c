@@ -2,6 +2,8 @@
 #include "lexer.h"
 #include "parser.h"
 #include "functions.h"
+#include "resolver.h"
+#include "optimizer.h"
 #include "common.h"
 
 #define UNPACK(...) __VA_ARGS__
@@ -31,6 +33,10 @@ struct parser {
 		TokenData * previous_token;
 	))
 	ExprNode * popped_parsed_node;
+	bool optimize;
+	bool inline_functions;
+	bool resolved;
+	ScopeLayout root_layout;
 };
 
 static void
@@ -43,6 +49,11 @@ parsed_expr_node_destructor(ExprNode * node)
 		}
 		free(node->as_FunctionApplication.args);
 		break;
+	case EXPRNODE_ShortCircuit:
+		destruct_expression(&node->as_ShortCircuit.args[0]);
+		destruct_expression(&node->as_ShortCircuit.args[1]);
+		free(node->as_ShortCircuit.args);
+		break;
 	case EXPRNODE_Literal:
 		break;
 	case EXPRNODE_Assign:
@@ -54,9 +65,11 @@ parsed_expr_node_destructor(ExprNode * node)
 		destruct_expression(node->as_Reassign.rhs);
 		free(node->as_Reassign.rhs);
 		free(node->as_Assign.name);
+		free_variable_resolution(&node->as_Reassign.resolution);
 		break;
 	case EXPRNODE_Variable:
 		free(node->as_Variable.name);
+		free_variable_resolution(&node->as_Variable.resolution);
 		break;
 	case EXPRNODE_StatementList:
 		for (uint64_t i = 0; i < node->as_StatementList.length; ++i) {
@@ -69,12 +82,39 @@ parsed_expr_node_destructor(ExprNode * node)
 		destruct_expression(node->as_LoopWhile.condition);
 		free(node->as_LoopWhile.body);
 		free(node->as_LoopWhile.condition);
+		free_scope_layout(&node->as_LoopWhile.layout);
+		break;
+	case EXPRNODE_LoopRepeat:
+		if (node->as_LoopRepeat.body) {
+			destruct_expression(node->as_LoopRepeat.body);
+		}
+		if (node->as_LoopRepeat.count) {
+			destruct_expression(node->as_LoopRepeat.count);
+		}
+		free(node->as_LoopRepeat.body);
+		free(node->as_LoopRepeat.count);
+		free(node->as_LoopRepeat.index_name);
+		free_scope_layout(&node->as_LoopRepeat.layout);
 		break;
 	case EXPRNODE_CondIf:
 		destruct_expression(node->as_CondIf.body);
 		destruct_expression(node->as_CondIf.condition);
 		free(node->as_CondIf.body);
 		free(node->as_CondIf.condition);
+		free_scope_layout(&node->as_CondIf.layout);
+		break;
+	case EXPRNODE_Switch:
+		if (node->as_Switch.value) {
+			destruct_expression(node->as_Switch.value);
+			free(node->as_Switch.value);
+		}
+		for (uint64_t i = 0; i < node->as_Switch.case_count + node->as_Switch.has_default; ++i) {
+			destruct_expression(&node->as_Switch.bodies[i]);
+		}
+		free(node->as_Switch.bodies);
+		free(node->as_Switch.labels);
+		free_switch_dispatch(&node->as_Switch.dispatch);
+		free_scope_layout(&node->as_Switch.layout);
 		break;
 	case EXPRNODE_UserFunctionDef:
 		if (node->as_UserFunctionDef.args.entries) {
@@ -89,6 +129,7 @@ parsed_expr_node_destructor(ExprNode * node)
 		destruct_expression(node->as_UserFunctionDef.body);
 		free(node->as_UserFunctionDef.body);
 		free(node->as_UserFunctionDef.name);
+		free_scope_layout(&node->as_UserFunctionDef.layout);
 		break;
 	case EXPRNODE_UserFunctionCall:
 		for (uint64_t i = 0; i < node->as_UserFunctionCall.arg_count; ++i) {
@@ -97,6 +138,18 @@ parsed_expr_node_destructor(ExprNode * node)
 		free(node->as_UserFunctionCall.args);
 		free(node->as_UserFunctionCall.name);
 		break;
+	case EXPRNODE_InlinedCall:
+		for (uint64_t i = 0; i < node->as_InlinedCall.params.length; ++i) {
+			destruct_expression(&node->as_InlinedCall.args[i]);
+			free(node->as_InlinedCall.params.entries[i].name);
+		}
+		free(node->as_InlinedCall.args);
+		free(node->as_InlinedCall.params.entries);
+		destruct_expression(node->as_InlinedCall.body);
+		free(node->as_InlinedCall.body);
+		free(node->as_InlinedCall.name);
+		free_scope_layout(&node->as_InlinedCall.layout);
+		break;
 	}
 }
 
@@ -112,6 +165,8 @@ parser_new()
 	*parser = (Parser) {
 		.lexer = lexer,
 		.code_end = false,
+		.optimize = true,
+		.inline_functions = true,
 	};
 	return parser;
 }
@@ -128,6 +183,7 @@ parser_delete(Parser * parser)
 		free(parser->parsed_node);
 		parser->parsed_node = NULL;
 	}
+	free_scope_layout(&parser->root_layout);
 	free(parser);
 }
 
@@ -182,7 +238,8 @@ parser_consume_token(Parser * parser)
 static ExprNode *
 allocate_expr_node()
 {
-	ExprNode * node = malloc(sizeof(ExprNode));
+	// Zeroed, so that nodes the optimizer drops before resolution have nothing to free yet
+	ExprNode * node = calloc(1, sizeof(ExprNode));
 	if (!node) {
 		fprintf(stderr, "Failed to allocate expression node\n");
 		exit(1);
@@ -201,6 +258,58 @@ make_noop_expr()
 	return statement_list_node;
 }
 
+// Splits the operands collected in bodies into the value, labels, bodies and default body
+static void
+finish_switch(SwitchExprNode * self)
+{
+	ExprNode * operands = self->bodies;
+	uint64_t operand_count = self->case_count;
+	if (!operand_count) {
+		fprintf(stderr, "Expected a value to switch on\n");
+		exit(1);
+	}
+	self->case_count = (operand_count - 1) / 2;
+	self->has_default = (operand_count - 1) % 2;
+	if (!(self->value = malloc(sizeof(ExprNode)))) {
+		fprintf(stderr, "Failed to allocate switch value\n");
+		exit(1);
+	}
+	*self->value = operands[0];  // MOVE contents
+	self->labels = calloc(self->case_count ? self->case_count : 1, sizeof(uint64_t));
+	self->bodies = calloc(self->case_count + 1, sizeof(ExprNode));
+	if (!self->labels || !self->bodies) {
+		fprintf(stderr, "Failed to allocate switch cases\n");
+		exit(1);
+	}
+	for (uint64_t i = 0; i < self->case_count; ++i) {
+		ExprNode * label = &operands[1 + 2 * i];
+		if (label->node_type != EXPRNODE_Literal) {
+			fprintf(stderr, "Expected a number as switch case label, got expression of type %s\n", expr_node_types[label->node_type]);
+			exit(1);
+		}
+		self->labels[i] = label->as_Literal.value.value;
+		self->bodies[i] = operands[2 + 2 * i];  // MOVE contents
+	}
+	if (self->has_default)
+		self->bodies[self->case_count] = operands[operand_count - 1];  // MOVE contents
+	free(operands);
+	build_switch_dispatch(self);
+}
+
+// and/or become ShortCircuit nodes, which only evaluate their second operand when it's needed
+static void
+make_short_circuit(ExprNode * node)
+{
+	const char * name = node->as_FunctionApplication.func->name;
+	bool is_or = !strcmp(name, "or");
+	if (!is_or && strcmp(name, "and"))
+		return;
+	ExprNode * args = node->as_FunctionApplication.args;
+	node->node_type = EXPRNODE_ShortCircuit;
+	node->as_ShortCircuit.is_or = is_or;
+	node->as_ShortCircuit.args = args;
+}
+
 static void
 parser_before_expression_end(Parser * parser)
 {
@@ -257,6 +366,13 @@ parser_feed(Parser * parser, char * ptr, size_t length)
 							case KWTT_IF:
 								node->node_type = EXPRNODE_CondIf;
 								break;
+							case KWTT_SWITCH:
+								// Its operands are collected in bodies until the ')'
+								node->node_type = EXPRNODE_Switch;
+								break;
+							case KWTT_REPEAT:
+								node->node_type = EXPRNODE_LoopRepeat;
+								break;
 							default:
 								fprintf(stderr, "Unexpected keyword of type #%d before a '('\n", parser->previous_token->as_Keyword.keyword_type);
 								exit(1);
@@ -266,7 +382,10 @@ parser_feed(Parser * parser, char * ptr, size_t length)
 							parser->mode = PSMD_WAIT_POP;
 							parser->call_iteration = 0;
 							parser_push_state(parser);
-							parser->pop_before_semicolon = true;
+							if (node->node_type == EXPRNODE_Switch || node->node_type == EXPRNODE_LoopRepeat)
+								parser->pop_on_comma = true;
+							else
+								parser->pop_before_semicolon = true;
 						}
 						break;
 					case TOKENTYPE_Identifier: {
@@ -358,6 +477,8 @@ parser_feed(Parser * parser, char * ptr, size_t length)
 					switch (parser->token->as_Keyword.keyword_type) {
 					case KWTT_WHILE:
 					case KWTT_IF:
+					case KWTT_SWITCH:
+					case KWTT_REPEAT:
 						parser->previous_token = parser->token;
 						parser->token = NULL;
 						break;
@@ -377,6 +498,7 @@ parser_feed(Parser * parser, char * ptr, size_t length)
 							node->as_UserFunctionCall.name = NULL;
 							node->as_UserFunctionCall.arg_count = 0;
 							node->as_UserFunctionCall.args = NULL;
+							node->as_UserFunctionCall.cached_func = NULL;
 							break;
 						default:
 							break;
@@ -452,6 +574,7 @@ parser_feed(Parser * parser, char * ptr, size_t length)
 					parser->call_iteration = 0;
 					parser->expression_end = true;
 					parser->mode = PSMD_NORMAL;
+					make_short_circuit(parser->parsed_node);
 				}
 				parser->after_comma = false;
 				break;
@@ -554,6 +677,70 @@ parser_feed(Parser * parser, char * ptr, size_t length)
 				}
 				parser->after_comma = false;
 				break;
+			case EXPRNODE_Switch:
+				if (parser->popped_parsed_node) {
+					SwitchExprNode * self = &parser->parsed_node->as_Switch;
+					if (!(self->bodies = reallocarray(self->bodies, self->case_count + 1, sizeof(ExprNode)))) {
+						fprintf(stderr, "Failed to resize switch operand array\n");
+						exit(1);
+					}
+					self->bodies[self->case_count++] = *parser->popped_parsed_node;  // MOVE contents
+					free(parser->popped_parsed_node);  // FREE extra pointer
+					parser->popped_parsed_node = NULL;
+				}
+				if (parser->token && parser->token->token_type == TOKENTYPE_RParen) {
+					parser_consume_token(parser);
+					finish_switch(&parser->parsed_node->as_Switch);
+					parser->expression_end = true;
+					parser->mode = PSMD_NORMAL;
+				} else {
+					parser_push_state(parser);
+					parser->pop_on_comma = true;
+				}
+				parser->after_comma = false;
+				break;
+			case EXPRNODE_LoopRepeat: {
+					LoopRepeatExprNode * self = &parser->parsed_node->as_LoopRepeat;
+					if (parser->popped_parsed_node) {
+						switch (parser->call_iteration++) {
+						case 0:
+							self->count = parser->popped_parsed_node;  // MOVE
+							break;
+						case 1:
+							self->body = parser->popped_parsed_node;  // MOVE
+							break;
+						case 2:
+							// The body so far was the index
+							if (self->body->node_type != EXPRNODE_Variable) {
+								fprintf(stderr, "Expected variable expression as repeat index, got type %s\n", expr_node_types[self->body->node_type]);
+								exit(1);
+							}
+							self->index_name = self->body->as_Variable.name;  // MOVE
+							free(self->body);
+							self->body = parser->popped_parsed_node;  // MOVE
+							break;
+						default:
+							fprintf(stderr, "Too many operands for repeat\n");
+							exit(1);
+						}
+						parser->popped_parsed_node = NULL;
+					}
+					if (parser->token && parser->token->token_type == TOKENTYPE_RParen) {
+						parser_consume_token(parser);
+						if (parser->call_iteration < 2) {
+							fprintf(stderr, "Expected a count and a body for repeat\n");
+							exit(1);
+						}
+						parser->call_iteration = 0;
+						parser->expression_end = true;
+						parser->mode = PSMD_NORMAL;
+					} else {
+						parser_push_state(parser);
+						parser->pop_on_comma = true;
+					}
+					parser->after_comma = false;
+				}
+				break;
 			case EXPRNODE_UserFunctionDef:
 				if (!parser->call_iteration) {
 					// Arguments
@@ -675,5 +862,32 @@ parser_end(Parser * parser)
 	if (!parser->parsed_node) {
 		parser->parsed_node = make_noop_expr();
 	}
+	if (!parser->resolved) {
+		if (parser->optimize) {
+			optimize_expression(parser->parsed_node);
+			if (parser->inline_functions)
+				inline_user_functions(parser->parsed_node);
+		}
+		parser->root_layout = resolve_variables(parser->parsed_node);
+		parser->resolved = true;
+	}
 	return parser->parsed_node;
 }
+
+void
+parser_set_optimize(Parser * parser, bool optimize)
+{
+	parser->optimize = optimize;
+}
+
+void
+parser_set_inline(Parser * parser, bool inline_functions)
+{
+	parser->inline_functions = inline_functions;
+}
+
+const ScopeLayout *
+parser_root_layout(Parser * parser)
+{
+	return &parser->root_layout;
+}
@@ -15,6 +15,14 @@ void parser_feed(Parser * parser, char * ptr, size_t length);
 
 const ExprNode * parser_end(Parser * parser);
 
+// Whether parser_end runs optimize_expression on the program, on by default
+void parser_set_optimize(Parser * parser, bool optimize);
+// Whether the optimizer also inlines small user functions, on by default
+void parser_set_inline(Parser * parser, bool inline_functions);
+
+// Slots of the program's outermost scope, valid after parser_end
+const ScopeLayout * parser_root_layout(Parser * parser);
+
 void parser_delete(Parser * parser);
 
 #endif /* end of include guard: PARSER_H_ */
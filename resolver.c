@@ -0,0 +1,416 @@
+#include "resolver.h"
+#include "common.h"
+#include "name_table.h"
+
+#include <string.h>
+
+// Scoping is dynamic: a name may or may not be bound in a scope depending on what ran, and functions see the
+// variables of their callers. So a variable resolves to every enclosing scope of its function (or of the program)
+// that assigns the name somewhere, to be checked innermost first at runtime, and to a search of the callers'
+// scopes by name after that.
+
+// Both the canonical names (layout NULL) and the slots of each layout, so that large programs resolve in linear time
+typedef struct {
+	const ScopeLayout *layout;
+	char *name;  // Canonical, owned by the AST
+	uint32_t slot;
+} ResolverEntry;
+
+typedef struct {
+	ResolverEntry *entries;
+	size_t count, capacity;
+	ScopeLayout **scopes;  // Enclosing scopes, from the program's down to the current one
+	size_t depth, scope_capacity;
+	size_t unit_start;  // Index in scopes of the current function's own scope
+	ScopeLayout *root;
+} Resolver;
+
+static void *
+resolver_grow(void * array, size_t * capacity, size_t needed, size_t item_size)
+{
+	if (needed <= *capacity)
+		return array;
+	size_t new_capacity = *capacity ? *capacity << 1 : 16;
+	while (new_capacity < needed)
+		new_capacity <<= 1;
+	void * new_array = realloc(array, new_capacity * item_size);
+	if (!new_array) {
+		fprintf(stderr, "Failed to allocate variable resolution\n");
+		exit(1);
+	}
+	*capacity = new_capacity;
+	return new_array;
+}
+
+static size_t
+entry_hash(const ScopeLayout * layout, const char * name)
+{
+	return name_hash(name, strlen(name)) ^ ((uintptr_t) layout >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+static ResolverEntry *
+entry_probe(ResolverEntry * entries, size_t capacity, const ScopeLayout * layout, const char * name)
+{
+	size_t i = entry_hash(layout, name) & (capacity - 1);
+	while (entries[i].name && (entries[i].layout != layout || strcmp(entries[i].name, name)))
+		i = (i + 1) & (capacity - 1);
+	return &entries[i];
+}
+
+// Returns the entry, which has a NULL name if it's new
+static ResolverEntry *
+resolver_entry(Resolver * resolver, const ScopeLayout * layout, const char * name)
+{
+	if ((resolver->count + 1) << 1 > resolver->capacity) {
+		size_t new_capacity = resolver->capacity ? resolver->capacity << 1 : 64;
+		ResolverEntry *entries = calloc(new_capacity, sizeof(ResolverEntry));
+		if (!entries) {
+			fprintf(stderr, "Failed to allocate variable resolution\n");
+			exit(1);
+		}
+		for (size_t i = 0; i < resolver->capacity; ++i) {
+			if (resolver->entries[i].name)
+				*entry_probe(entries, new_capacity, resolver->entries[i].layout, resolver->entries[i].name) = resolver->entries[i];
+		}
+		free(resolver->entries);
+		resolver->entries = entries;
+		resolver->capacity = new_capacity;
+	}
+	return entry_probe(resolver->entries, resolver->capacity, layout, name);
+}
+
+static char *
+intern_name(Resolver * resolver, char * name)
+{
+	ResolverEntry * entry = resolver_entry(resolver, NULL, name);
+	if (!entry->name) {
+		*entry = (ResolverEntry) {
+			.layout = NULL,
+			.name = name,
+		};
+		++resolver->count;
+	}
+	return entry->name;
+}
+
+static bool
+layout_find(Resolver * resolver, const ScopeLayout * layout, char * canonical, uint32_t * slot)
+{
+	ResolverEntry * entry = resolver_entry(resolver, layout, canonical);
+	if (!entry->name)
+		return false;
+	*slot = entry->slot;
+	return true;
+}
+
+// A repeated formal argument keeps the last slot with the name, so it takes the last value like it used to
+static uint32_t
+layout_append(Resolver * resolver, ScopeLayout * layout, char * canonical)
+{
+	// Layouts are only built here, so a power of two capacity can be derived from the count
+	if (!(layout->slot_count & (layout->slot_count - 1))) {
+		char **names = realloc(layout->names, (layout->slot_count ? layout->slot_count << 1 : 1) * sizeof(char *));
+		if (!names) {
+			fprintf(stderr, "Failed to allocate scope layout\n");
+			exit(1);
+		}
+		layout->names = names;
+	}
+	ResolverEntry * entry = resolver_entry(resolver, layout, canonical);
+	if (!entry->name)
+		++resolver->count;
+	*entry = (ResolverEntry) {
+		.layout = layout,
+		.name = canonical,
+		.slot = layout->slot_count,
+	};
+	layout->names[layout->slot_count] = canonical;
+	return layout->slot_count++;
+}
+
+static uint32_t
+layout_declare(Resolver * resolver, ScopeLayout * layout, char * canonical)
+{
+	uint32_t slot;
+	if (layout_find(resolver, layout, canonical, &slot))
+		return slot;
+	return layout_append(resolver, layout, canonical);
+}
+
+// First pass: collect the slots of every scope, assignments go to the current scope and
+// reassignments of unbound names to the outermost one
+
+static void
+declare_expression(Resolver * resolver, ExprNode * expr, ScopeLayout * scope)
+{
+	// The parser may leave out an unfinished last operand
+	if (!expr)
+		return;
+	switch (expr->node_type) {
+	case EXPRNODE_FunctionApplication:
+		for (uint64_t i = 0; i < expr->as_FunctionApplication.arg_count; ++i)
+			declare_expression(resolver, &expr->as_FunctionApplication.args[i], scope);
+		break;
+	case EXPRNODE_ShortCircuit:
+		declare_expression(resolver, &expr->as_ShortCircuit.args[0], scope);
+		declare_expression(resolver, &expr->as_ShortCircuit.args[1], scope);
+		break;
+	case EXPRNODE_Literal:
+		break;
+	case EXPRNODE_Assign:
+		expr->as_Assign.slot = layout_declare(resolver, scope, intern_name(resolver, expr->as_Assign.name));
+		declare_expression(resolver, expr->as_Assign.rhs, scope);
+		break;
+	case EXPRNODE_Reassign:
+		expr->as_Reassign.root_slot = layout_declare(resolver, resolver->root, intern_name(resolver, expr->as_Reassign.name));
+		declare_expression(resolver, expr->as_Reassign.rhs, scope);
+		break;
+	case EXPRNODE_Variable:
+		break;
+	case EXPRNODE_StatementList:
+		for (uint64_t i = 0; i < expr->as_StatementList.length; ++i)
+			declare_expression(resolver, &expr->as_StatementList.args[i], scope);
+		break;
+	case EXPRNODE_LoopWhile:
+		expr->as_LoopWhile.layout = (ScopeLayout) {0, NULL};
+		declare_expression(resolver, expr->as_LoopWhile.condition, &expr->as_LoopWhile.layout);
+		declare_expression(resolver, expr->as_LoopWhile.body, &expr->as_LoopWhile.layout);
+		break;
+	case EXPRNODE_LoopRepeat: {
+		LoopRepeatExprNode * self = &expr->as_LoopRepeat;
+		self->layout = (ScopeLayout) {0, NULL};
+		if (self->index_name)
+			self->index_slot = layout_append(resolver, &self->layout, intern_name(resolver, self->index_name));
+		declare_expression(resolver, self->count, &self->layout);
+		declare_expression(resolver, self->body, &self->layout);
+	} break;
+	case EXPRNODE_CondIf:
+		expr->as_CondIf.layout = (ScopeLayout) {0, NULL};
+		declare_expression(resolver, expr->as_CondIf.condition, &expr->as_CondIf.layout);
+		declare_expression(resolver, expr->as_CondIf.body, &expr->as_CondIf.layout);
+		break;
+	case EXPRNODE_Switch: {
+		SwitchExprNode * self = &expr->as_Switch;
+		self->layout = (ScopeLayout) {0, NULL};
+		declare_expression(resolver, self->value, &self->layout);
+		for (uint64_t i = 0; i < self->case_count + self->has_default; ++i)
+			declare_expression(resolver, &self->bodies[i], &self->layout);
+	} break;
+	case EXPRNODE_UserFunctionCall:
+		// Arguments are evaluated in the caller's scope
+		for (uint64_t i = 0; i < expr->as_UserFunctionCall.arg_count; ++i)
+			declare_expression(resolver, &expr->as_UserFunctionCall.args[i], scope);
+		break;
+	case EXPRNODE_InlinedCall: {
+		// Like a call, but the body belongs to the caller's function
+		InlinedCallExprNode * self = &expr->as_InlinedCall;
+		for (uint64_t i = 0; i < self->params.length; ++i)
+			declare_expression(resolver, &self->args[i], scope);
+		self->layout = (ScopeLayout) {0, NULL};
+		for (uint64_t i = 0; i < self->params.length; ++i)
+			layout_append(resolver, &self->layout, intern_name(resolver, self->params.entries[i].name));
+		declare_expression(resolver, self->body, &self->layout);
+	} break;
+	case EXPRNODE_UserFunctionDef: {
+		UserFunctionDefExprNode * self = &expr->as_UserFunctionDef;
+		self->layout = (ScopeLayout) {0, NULL};
+		for (uint64_t i = 0; i < self->args.length; ++i)
+			layout_append(resolver, &self->layout, intern_name(resolver, self->args.entries[i].name));
+		declare_expression(resolver, self->body, &self->layout);
+	} break;
+	}
+}
+
+// A call whose value is the value of its function, with no scope pushed in between, can reuse the running
+// call when it turns out to call the same function: arguments are rebound in place and locals keep their
+// bindings, which is what the new call would find through its callers anyway
+
+static void
+mark_tail_calls(ExprNode * expr, const ScopeLayout * function_layout)
+{
+	if (!expr)
+		return;
+	switch (expr->node_type) {
+	case EXPRNODE_StatementList:
+		if (expr->as_StatementList.length)
+			mark_tail_calls(&expr->as_StatementList.args[expr->as_StatementList.length - 1], function_layout);
+		break;
+	case EXPRNODE_CondIf:
+		if (!expr->as_CondIf.layout.slot_count)
+			mark_tail_calls(expr->as_CondIf.body, function_layout);
+		break;
+	case EXPRNODE_Switch:
+		if (!expr->as_Switch.layout.slot_count) {
+			for (uint64_t i = 0; i < expr->as_Switch.case_count + expr->as_Switch.has_default; ++i)
+				mark_tail_calls(&expr->as_Switch.bodies[i], function_layout);
+		}
+		break;
+	case EXPRNODE_UserFunctionCall:
+		expr->as_UserFunctionCall.tail_layout = function_layout;
+		break;
+	default:
+		break;
+	}
+}
+
+// Second pass: resolve the accesses against the scopes that enclose them
+
+static void
+push_scope(Resolver * resolver, ScopeLayout * layout)
+{
+	resolver->scopes = resolver_grow(resolver->scopes, &resolver->scope_capacity, resolver->depth + 1, sizeof(ScopeLayout *));
+	resolver->scopes[resolver->depth++] = layout;
+}
+
+// Scopes without slots are elided at runtime, see scope_enter, so they don't count in the depths
+static void
+enter_scope(Resolver * resolver, ScopeLayout * layout)
+{
+	if (layout->slot_count)
+		push_scope(resolver, layout);
+}
+
+static void
+leave_scope(Resolver * resolver, const ScopeLayout * layout)
+{
+	if (layout->slot_count)
+		--resolver->depth;
+}
+
+static VariableResolution
+resolve_name(Resolver * resolver, char * name)
+{
+	VariableResolution resolution = {
+		.name = intern_name(resolver, name),
+		.candidate_count = 0,
+		.candidates = NULL,
+		.unit_depth = resolver->depth - resolver->unit_start,
+	};
+	for (size_t i = resolver->depth; i-- > resolver->unit_start;) {
+		uint32_t slot;
+		if (!layout_find(resolver, resolver->scopes[i], resolution.name, &slot))
+			continue;
+		resolution.candidates = realloc(resolution.candidates, (resolution.candidate_count + 1) * sizeof(ScopeSlotRef));
+		if (!resolution.candidates) {
+			fprintf(stderr, "Failed to allocate variable resolution\n");
+			exit(1);
+		}
+		resolution.candidates[resolution.candidate_count++] = (ScopeSlotRef) {
+			.depth = resolver->depth - 1 - i,
+			.slot = slot,
+		};
+	}
+	return resolution;
+}
+
+static void
+resolve_expression(Resolver * resolver, ExprNode * expr)
+{
+	if (!expr)
+		return;
+	switch (expr->node_type) {
+	case EXPRNODE_FunctionApplication:
+		for (uint64_t i = 0; i < expr->as_FunctionApplication.arg_count; ++i)
+			resolve_expression(resolver, &expr->as_FunctionApplication.args[i]);
+		break;
+	case EXPRNODE_ShortCircuit:
+		resolve_expression(resolver, &expr->as_ShortCircuit.args[0]);
+		resolve_expression(resolver, &expr->as_ShortCircuit.args[1]);
+		break;
+	case EXPRNODE_Literal:
+		break;
+	case EXPRNODE_Assign:
+		resolve_expression(resolver, expr->as_Assign.rhs);
+		break;
+	case EXPRNODE_Reassign:
+		expr->as_Reassign.resolution = resolve_name(resolver, expr->as_Reassign.name);
+		resolve_expression(resolver, expr->as_Reassign.rhs);
+		break;
+	case EXPRNODE_Variable:
+		expr->as_Variable.resolution = resolve_name(resolver, expr->as_Variable.name);
+		break;
+	case EXPRNODE_StatementList:
+		for (uint64_t i = 0; i < expr->as_StatementList.length; ++i)
+			resolve_expression(resolver, &expr->as_StatementList.args[i]);
+		break;
+	case EXPRNODE_LoopWhile:
+		enter_scope(resolver, &expr->as_LoopWhile.layout);
+		resolve_expression(resolver, expr->as_LoopWhile.condition);
+		resolve_expression(resolver, expr->as_LoopWhile.body);
+		leave_scope(resolver, &expr->as_LoopWhile.layout);
+		break;
+	case EXPRNODE_LoopRepeat:
+		enter_scope(resolver, &expr->as_LoopRepeat.layout);
+		resolve_expression(resolver, expr->as_LoopRepeat.count);
+		resolve_expression(resolver, expr->as_LoopRepeat.body);
+		leave_scope(resolver, &expr->as_LoopRepeat.layout);
+		break;
+	case EXPRNODE_CondIf:
+		enter_scope(resolver, &expr->as_CondIf.layout);
+		resolve_expression(resolver, expr->as_CondIf.condition);
+		resolve_expression(resolver, expr->as_CondIf.body);
+		leave_scope(resolver, &expr->as_CondIf.layout);
+		break;
+	case EXPRNODE_Switch: {
+		SwitchExprNode * self = &expr->as_Switch;
+		enter_scope(resolver, &self->layout);
+		resolve_expression(resolver, self->value);
+		for (uint64_t i = 0; i < self->case_count + self->has_default; ++i)
+			resolve_expression(resolver, &self->bodies[i]);
+		leave_scope(resolver, &self->layout);
+	} break;
+	case EXPRNODE_UserFunctionCall:
+		for (uint64_t i = 0; i < expr->as_UserFunctionCall.arg_count; ++i)
+			resolve_expression(resolver, &expr->as_UserFunctionCall.args[i]);
+		break;
+	case EXPRNODE_InlinedCall: {
+		InlinedCallExprNode * self = &expr->as_InlinedCall;
+		for (uint64_t i = 0; i < self->params.length; ++i)
+			resolve_expression(resolver, &self->args[i]);
+		enter_scope(resolver, &self->layout);
+		resolve_expression(resolver, self->body);
+		leave_scope(resolver, &self->layout);
+	} break;
+	case EXPRNODE_UserFunctionDef: {
+		// The body runs on top of the caller's scope, in one of its own if it has slots, wherever the definition is
+		size_t unit_start = resolver->unit_start;
+		resolver->unit_start = resolver->depth;
+		enter_scope(resolver, &expr->as_UserFunctionDef.layout);
+		resolve_expression(resolver, expr->as_UserFunctionDef.body);
+		leave_scope(resolver, &expr->as_UserFunctionDef.layout);
+		mark_tail_calls(expr->as_UserFunctionDef.body, &expr->as_UserFunctionDef.layout);
+		resolver->unit_start = unit_start;
+	} break;
+	}
+}
+
+ScopeLayout
+resolve_variables(ExprNode * program)
+{
+	ScopeLayout root = {0, NULL};
+	Resolver resolver = {
+		.root = &root,
+	};
+	declare_expression(&resolver, program, &root);
+	push_scope(&resolver, &root);
+	resolve_expression(&resolver, program);
+	free(resolver.entries);
+	free(resolver.scopes);
+	return root;
+}
+
+void
+free_scope_layout(ScopeLayout * layout)
+{
+	// The names belong to the AST
+	free(layout->names);
+	*layout = (ScopeLayout) {0, NULL};
+}
+
+void
+free_variable_resolution(VariableResolution * resolution)
+{
+	free(resolution->candidates);
+	resolution->candidates = NULL;
+	resolution->candidate_count = 0;
+}
@@ -0,0 +1,14 @@
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+
+#include "interp_types.h"
+#include "expression.h"
+
+// Gives every scope of the program a layout of slots and resolves variable accesses to them.
+// Returns the layout of the outermost scope, which the caller owns.
+ScopeLayout resolve_variables(ExprNode * program);
+
+void free_scope_layout(ScopeLayout * layout);
+void free_variable_resolution(VariableResolution * resolution);
+
+#endif /* end of include guard: RESOLVER_H_ */
@@ -0,0 +1,89 @@
+// Checks bit_slice_copy with each shift-merge kernel against a bit by bit copy, for every pair of source and
+// destination offsets within two bytes and lengths past what the widest kernel copies in one go
+
+#include "../bitio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_SIZE 96
+#define MAX_OFFSET 16
+#define MAX_LENGTH ((BUFFER_SIZE - 4) * 8 - MAX_OFFSET)
+
+static const struct {
+	enum bit_copy_kernel kernel;
+	const char *name;
+} kernels[] = {
+	{BIT_COPY_KERNEL_SCALAR, "scalar"},
+	{BIT_COPY_KERNEL_SSE2, "sse2"},
+	{BIT_COPY_KERNEL_AVX2, "avx2"},
+};
+
+static uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+static uint8_t
+random_byte(void)
+{
+	// xorshift64
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state >> 56;
+}
+
+// Bit 0 is the most significant bit of the first byte, like in BitIO
+static void
+reference_copy(uint8_t * dst, size_t dst_offset, const uint8_t * src, size_t src_offset, size_t length)
+{
+	for (size_t i = 0; i < length; ++i) {
+		size_t s = src_offset + i, d = dst_offset + i;
+		unsigned bit = (src[s >> 3] >> (7 - (s & 7))) & 1;
+		dst[d >> 3] = (dst[d >> 3] & ~(0x80 >> (d & 7))) | (bit << (7 - (d & 7)));
+	}
+}
+
+static size_t
+check_kernel(const char * name)
+{
+	uint8_t src[BUFFER_SIZE], dst[BUFFER_SIZE], expected[BUFFER_SIZE];
+	size_t failures = 0;
+	for (size_t src_offset = 0; src_offset < MAX_OFFSET; ++src_offset) {
+		for (size_t dst_offset = 0; dst_offset < MAX_OFFSET; ++dst_offset) {
+			for (size_t length = 0; length <= MAX_LENGTH; ++length) {
+				for (size_t i = 0; i < BUFFER_SIZE; ++i) {
+					src[i] = random_byte();
+					dst[i] = expected[i] = random_byte();
+				}
+				reference_copy(expected, dst_offset, src, src_offset, length);
+				// The source may be longer, the copy stops at the destination's end
+				BitSlice dst_slice = {.ptr = dst, .offset = dst_offset, .length = length};
+				BitConstSlice src_slice = {.ptr = src, .offset = src_offset, .length = length + (length & 1)};
+				BitUSize copied = bit_slice_copy(dst_slice, src_slice);
+				if (copied != length || memcmp(dst, expected, BUFFER_SIZE)) {
+					if (++failures <= 10) {
+						fprintf(stderr, "%s: wrong copy of %zu bits from offset %zu to offset %zu\n",
+							name, length, src_offset, dst_offset);
+					}
+				}
+			}
+		}
+	}
+	return failures;
+}
+
+int
+main(void)
+{
+	size_t failures = 0;
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+		if (!bit_slice_copy_use_kernel(kernels[i].kernel)) {
+			printf("bit_slice_copy %s: not supported here, skipped\n", kernels[i].name);
+			continue;
+		}
+		size_t kernel_failures = check_kernel(kernels[i].name);
+		printf("bit_slice_copy %s: %s\n", kernels[i].name, kernel_failures ? "FAILED" : "ok");
+		failures += kernel_failures;
+	}
+	return failures ? 1 : 0;
+}
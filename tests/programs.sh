@@ -0,0 +1,62 @@
+#!/bin/sh
+# Runs programs with every engine and compares their output with the expected bytes
+# Usage: tests/programs.sh [path to bitstreamop]
+
+bitstreamop=${1:-./bitstreamop}
+BITSTREAMOP_CACHE_DIR=$(mktemp -d) || exit 1
+export BITSTREAMOP_CACHE_DIR
+trap 'rm -rf "$BITSTREAMOP_CACHE_DIR"' EXIT
+failures=0
+memory_limit=unlimited  # In KiB, for ulimit -v
+
+# check <name> <expected output as hex> <program> [input as a printf format]
+check() {
+	for engine in tree bytecode native; do
+		output=$(printf "${4-}" | (ulimit -v "$memory_limit" && exec "$bitstreamop" -e "$engine" "$3") | od -An -v -tx1 | tr -d ' \n')
+		if [ "$output" = "$2" ]; then
+			echo "$1 ($engine): ok"
+		else
+			echo "$1 ($engine): FAILED, got '$output' instead of '$2'"
+			failures=$((failures + 1))
+		fi
+	done
+}
+
+# One program per construct
+
+check switch 0663 \
+	'x = 2; write(width(8, switch(x, 0, 4, 1, 5, 2, (y = 6; y), 3, 7))); write(width(8, switch(9, 0, 4, 1, 5, 99)))'
+
+check repeat_with_index 0f02 \
+	's = 0; repeat(4, i, s := add(s, shl(1, i))); write(width(8, s)); write(width(8, repeat(3, i, i)))'
+
+# The assignments in the operands that aren't needed don't run
+check short_circuit 01000104 \
+	'x = 0; write(width(8, or(1, (x := 1; 0)))); write(width(8, and(0, (x := 2; 1)))); write(width(8, and(1, (x := add(x, 4); 1)))); write(width(8, x))'
+
+# Inlined bodies still see the caller's variables
+check inlined_call 05 \
+	'function g(a) add(a, c); function h(c) call g(1); write(width(8, call h(4)))'
+
+check copy_and_skip 4142444530 \
+	'write(read(4)); copy(12); skip(8); copy(16); skip(3); copy(5)' 'ABCDEFGH'
+
+# A call keeps to the definition it looked up, even when its arguments redefine the function
+check redefined_by_argument 06 \
+	'function f(a) add(a, 1); write(width(8, call f((function f(a, b, c) add(a, c); 5))))'
+
+# Calls that don't return right away nest on the native engine's C stack
+check deep_recursion 41 \
+	'function loop(n) if(n)(x = sub(n, 1); call loop(x)); call loop(100000); write(width(8, 65))'
+
+# Self tail calls reuse the running call's frame and scope, without that this depth needs several times the limit
+memory_limit=262144
+check tail_recursion 41 \
+	'function loop(n) if(n)(call loop(sub(n, 1))); call loop(3000000); write(width(8, 65))'
+memory_limit=unlimited
+
+# What was written before an error is still output (the error itself goes to stderr)
+check output_before_error 4142 \
+	'write(width(8, 65)); write(width(8, 66)); read(65)'
+
+[ "$failures" = 0 ]
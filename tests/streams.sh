@@ -0,0 +1,40 @@
+#!/bin/sh
+# Passes input through with every stream backend, between regular files and pipes, and compares the output with it
+# Usage: tests/streams.sh [path to bitstreamop]
+
+bitstreamop=${1:-./bitstreamop}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+failures=0
+
+# An odd size, so the last buffer is a partial one
+head -c 300001 /dev/urandom >"$dir/input" || exit 1
+
+# check <name> <options> <program that outputs its input unchanged>
+check() {
+	for route in file_to_file file_to_pipe pipe_to_file pipe_to_pipe; do
+		rm -f "$dir/output"
+		case $route in
+		file_to_file) "$bitstreamop" $2 "$3" <"$dir/input" >"$dir/output" ;;
+		file_to_pipe) "$bitstreamop" $2 "$3" <"$dir/input" | cat >"$dir/output" ;;
+		pipe_to_file) cat "$dir/input" | "$bitstreamop" $2 "$3" >"$dir/output" ;;
+		# A slow reader makes writes into the pipe wait or come back short
+		pipe_to_pipe) cat "$dir/input" | "$bitstreamop" $2 "$3" | (sleep 1; cat >"$dir/output") ;;
+		esac
+		if cmp -s "$dir/input" "$dir/output"; then
+			echo "$1 $2 ($route): ok"
+		else
+			echo "$1 $2 ($route): FAILED"
+			failures=$((failures + 1))
+		fi
+	done
+}
+
+for options in "" "--no-mmap" "--stdio" "-t" "--uring" "--uring -t" "--uring -i 1K -o 1K" "-t -i 1K -o 1K"; do
+	# Unaligned reads and writes through the accumulators
+	check bits "$options" 'while(not(readeof()))(a = read(3); b = read(5); write(a); write(b))'
+	# Whole chunks, which may be spliced or copied between the files
+	check copy "$options" 'copy(2400008)'
+done
+
+[ "$failures" = 0 ]
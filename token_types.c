@@ -1,5 +1,6 @@
 #include "token_types.h"
 #include "common.h"
+#include "name_table.h"
 
 #define UNPACK(...) __VA_ARGS__
 
@@ -35,13 +36,37 @@ print_token_data(TreePrinter * __printer, const TokenData * __token)
 	}
 }
 
-char *keyword_type_names[] = {
-	"while",
-	"if",
-	"function",
-	"call",
+char *keyword_type_names[KWTT_COUNT] = {
+#define BITSTREAMOP_KEYWORD(name, spelling) #spelling,
+#include "keywords.cc"
+#undef BITSTREAMOP_KEYWORD
 };
 
+#define KEYWORD_INDEX_CAPACITY 16
+_Static_assert(KEYWORD_INDEX_CAPACITY >= 2 * KWTT_COUNT, "Keyword index too small");
+static NameTableSlot keyword_index_slots[KEYWORD_INDEX_CAPACITY];
+static NameTable keyword_index = {
+	.mask = KEYWORD_INDEX_CAPACITY - 1,
+	.slots = keyword_index_slots,
+};
+
+__attribute__((constructor)) static void
+build_keyword_index(void)
+{
+	for (size_t i = 0; i < KWTT_COUNT; ++i)
+		name_table_insert(&keyword_index, keyword_type_names[i], i);
+}
+
+bool
+find_keyword(const char * ptr, size_t length, enum keyword_token_type * keyword_type)
+{
+	size_t index;
+	if (!name_table_find(&keyword_index, ptr, length, &index))
+		return false;
+	*keyword_type = (enum keyword_token_type) index;
+	return true;
+}
+
 char *token_type_names[] = {
 #define BITSTREAMOP_TOKEN(name, elements, printimpl) #name,
 #include "token_types.cc"
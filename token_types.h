@@ -8,13 +8,22 @@
 #define TOKEN_TYPES_H__UNPACK(...) __VA_ARGS__
 
 enum keyword_token_type {
-	KWTT_WHILE,
-	KWTT_IF,
-	KWTT_FUNCTION,
-	KWTT_CALL,
+#define BITSTREAMOP_KEYWORD(name, spelling) KWTT_##name,
+#include "keywords.cc"
+#undef BITSTREAMOP_KEYWORD
 };
 
-extern char *keyword_type_names[4];
+// Kept out of keyword_token_type so that switches over it stay exhaustive
+#define BITSTREAMOP_KEYWORD(name, spelling) + 1
+enum { KWTT_COUNT = 0
+#include "keywords.cc"
+};
+#undef BITSTREAMOP_KEYWORD
+
+extern char *keyword_type_names[KWTT_COUNT];
+
+// Returns false if the word isn't a keyword
+bool find_keyword(const char * ptr, size_t length, enum keyword_token_type * keyword_type);
 
 struct token_data;
 